@@ -0,0 +1,41 @@
+/* Shared by the benchmarks that time sinwm's own code paths. sinwm.c is
+ * included directly, with its main renamed out of the way. */
+
+#define main sinwm_main
+#include "../sinwm.c"
+#undef main
+
+#include <math.h>
+
+#define BENCH_LABEL_WIDTH 16
+#define BENCH_COLUMN_WIDTH 14
+
+typedef void (*bench_step_fn)(void *arg, int i);
+
+// Runs step count times and returns the mean time in ns per unit, where one
+// step covers units units of work.
+static double bench_time_ns(bench_step_fn step, void *arg, int count, double units) {
+  uint64_t start = now_us();
+  for (int i = 0; i < count; i++)
+    step(arg, i);
+  return (now_us() - start) * 1000.0 / (count * units);
+}
+
+static void bench_header(const char *label, const char *const *columns, int n) {
+  printf("%-*s", BENCH_LABEL_WIDTH, label);
+  for (int i = 0; i < n; i++)
+    printf(" %*s", BENCH_COLUMN_WIDTH, columns[i]);
+  printf("\n");
+}
+
+// NAN values print as "-".
+static void bench_row(const char *label, const double *values, int n) {
+  printf("%-*s", BENCH_LABEL_WIDTH, label);
+  for (int i = 0; i < n; i++) {
+    if (isnan(values[i]))
+      printf(" %*s", BENCH_COLUMN_WIDTH, "-");
+    else
+      printf(" %*.3f", BENCH_COLUMN_WIDTH, values[i]);
+  }
+  printf("\n");
+}
@@ -0,0 +1,105 @@
+/* Times the wallpaper pixel converters over strips of a 4K wallpaper for
+ * each pixel format with a fast path, against the generic converter, and
+ * checks the SIMD kernels against the scalar one. */
+
+#include "bench.h"
+
+#define WIDTH 3840
+#define ROWS WALLPAPER_STRIP_ROWS
+#define STRIPS 200
+
+typedef struct {
+  const char *name;
+  pixel_format_t format;
+  pixel_convert_fn kernels[3];
+} bench_format_t;
+
+static const char *kernel_names[3] = { "scalar", "sse2", "avx2" };
+
+typedef struct {
+  const pixel_format_t *format;
+  const uint8_t *src;
+  uint8_t *dst;
+} strip_run_t;
+
+static void strip_step(void *arg, int i) {
+  (void)i;
+  strip_run_t *r = arg;
+  convert_rows(r->format, r->src, WIDTH * 4, r->dst, format_stride(r->format, WIDTH), WIDTH, ROWS);
+}
+
+static double time_kernel(const pixel_format_t *f, const uint8_t *src, uint8_t *dst) {
+  strip_run_t r = { f, src, dst };
+  return bench_time_ns(strip_step, &r, STRIPS, (double)ROWS * WIDTH);
+}
+
+static void run(bench_format_t *b, const uint8_t *src, uint8_t *reference, uint8_t *dst) {
+  wallpaper_format = b->format;
+  size_t bytes = (size_t)format_stride(&wallpaper_format, WIDTH) * ROWS;
+
+  wallpaper_format.convert = convert_generic;
+  char label[32];
+  snprintf(label, sizeof(label), "%s generic", b->name);
+  double generic = time_kernel(&wallpaper_format, src, dst);
+  bench_row(label, (double[]){ generic, NAN }, 2);
+
+  for (int k = 0; k < 3; k++) {
+    if (!b->kernels[k])
+      continue;
+#ifdef SINWM_X86
+    if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !__builtin_cpu_supports("avx2")))
+      continue;
+#endif
+    wallpaper_format.convert = b->kernels[k];
+    uint8_t *out = k == 0 ? reference : dst;
+    memset(out, 0, bytes);
+    double ns = time_kernel(&wallpaper_format, src, out);
+    if (k > 0 && memcmp(out, reference, bytes) != 0)
+      fprintf(stderr, "%s %s output differs from the scalar kernel\n", b->name, kernel_names[k]);
+    snprintf(label, sizeof(label), "%s %s", b->name, kernel_names[k]);
+    bench_row(label, (double[]){ ns, generic / ns }, 2);
+  }
+}
+
+int main() {
+  bench_format_t formats[] = {
+    { "xrgb32", { 32, 32, XCB_IMAGE_ORDER_LSB_FIRST, XCB_VISUAL_CLASS_TRUE_COLOR, 0xFF0000, 0xFF00, 0xFF, NULL },
+      { convert_xrgb32_scalar } },
+    { "rgb30", { 32, 32, XCB_IMAGE_ORDER_LSB_FIRST, XCB_VISUAL_CLASS_TRUE_COLOR, 0x3FF00000, 0xFFC00, 0x3FF, NULL },
+      { convert_rgb30_scalar } },
+    { "rgb565", { 16, 32, XCB_IMAGE_ORDER_LSB_FIRST, XCB_VISUAL_CLASS_TRUE_COLOR, 0xF800, 0x7E0, 0x1F, NULL },
+      { convert_rgb565_scalar } }
+  };
+#ifdef SINWM_X86
+  __builtin_cpu_init();
+  formats[0].kernels[1] = convert_xrgb32_sse2;
+  formats[0].kernels[2] = convert_xrgb32_avx2;
+  formats[1].kernels[1] = convert_rgb30_sse2;
+  formats[1].kernels[2] = convert_rgb30_avx2;
+  formats[2].kernels[1] = convert_rgb565_sse2;
+  formats[2].kernels[2] = convert_rgb565_avx2;
+#endif
+
+  size_t src_bytes = (size_t)WIDTH * 4 * ROWS;
+  uint8_t *src = malloc(src_bytes);
+  uint8_t *reference = malloc(src_bytes);
+  uint8_t *dst = malloc(src_bytes);
+  if (!src || !reference || !dst)
+    return 1;
+
+  uint32_t seed = 1;
+  for (size_t i = 0; i < src_bytes; i++) {
+    seed = seed * 1103515245 + 12345;
+    src[i] = seed >> 16;
+  }
+
+  const char *columns[] = { "ns/pixel", "speedup" };
+  bench_header("kernel", columns, 2);
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    run(&formats[i], src, reference, dst);
+
+  free(src);
+  free(reference);
+  free(dst);
+  return 0;
+}
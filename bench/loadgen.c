@@ -0,0 +1,645 @@
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+#include <xcb/sync.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_BURST 32
+#define WARMUP_ITERATIONS 10
+#define WAIT_TIMEOUT_MS 1000
+#define MAX_OPS 16
+#define MAX_PHASES 8
+
+#define SHRUNK_WIDTH 1280
+#define SHRUNK_HEIGHT 720
+#define PROBE_X 1500
+#define SYNC_COUNTER_START 1000
+
+enum {
+  EXPECT_ACTIVE_WINDOW,
+  EXPECT_ACTIVE_CHANGED,
+  EXPECT_WM_STATE,
+  EXPECT_CONFIGURE_WIDTH,
+  EXPECT_CONFIGURE_X,
+  EXPECT_CONFIGURE_X_BELOW,
+  EXPECT_FOCUS_IN,
+  EXPECT_SYNC_REQUEST
+};
+
+typedef struct {
+  int kind;
+  xcb_window_t window;
+  int value;
+  int count;
+} expect_t;
+
+typedef struct {
+  const char *name;
+  uint64_t *samples;
+  int count;
+  int capacity;
+  int timeouts;
+} op_t;
+
+typedef struct {
+  const char *name;
+  int iterations;
+  double wm_cpu_us;
+} phase_t;
+
+static xcb_connection_t *conn;
+static xcb_screen_t *screen;
+static int wm_pid = 0;
+static int iterations = DEFAULT_ITERATIONS;
+static int burst = DEFAULT_BURST;
+static int hold = 0;
+
+static xcb_atom_t
+    atom_net_active_window
+  , atom_net_wm_state
+  , atom_net_wm_state_fullscreen
+  , atom_net_wm_state_above
+  , atom_net_supporting_wm_check
+  , atom_wm_protocols
+  , atom_net_wm_sync_request
+  , atom_net_wm_sync_request_counter;
+
+static op_t ops[MAX_OPS];
+static int op_count = 0;
+static phase_t phases[MAX_PHASES];
+static int phase_count = 0;
+
+static xcb_randr_crtc_t randr_crtc = XCB_NONE;
+static xcb_randr_output_t randr_output = XCB_NONE;
+static xcb_randr_mode_t randr_full_mode = XCB_NONE;
+static xcb_randr_mode_t randr_shrunk_mode = XCB_NONE;
+static xcb_timestamp_t randr_config_timestamp = XCB_CURRENT_TIME;
+static uint16_t full_width, full_height;
+static uint32_t full_mm_width, full_mm_height;
+
+static xcb_window_t sync_window = XCB_NONE;
+static xcb_sync_counter_t sync_counter = XCB_NONE;
+static uint64_t sync_counter_value = SYNC_COUNTER_START;
+static uint64_t sync_request_value = 0;
+static int sync_unseeded = 0;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double wm_cpu_us() {
+  if (wm_pid <= 0)
+    return 0;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/schedstat", wm_pid);
+  FILE *f = fopen(path, "r");
+  if (f) {
+    unsigned long long ns = 0;
+    int ok = fscanf(f, "%llu", &ns) == 1;
+    fclose(f);
+    if (ok)
+      return ns / 1000.0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", wm_pid);
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  char buffer[1024];
+  size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+  fclose(f);
+  buffer[n] = '\0';
+
+  char *p = strrchr(buffer, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return 0;
+
+  return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+static op_t *op(const char *name) {
+  for (int i = 0; i < op_count; i++) {
+    if (strcmp(ops[i].name, name) == 0)
+      return &ops[i];
+  }
+
+  op_t *o = &ops[op_count++];
+  o->name = name;
+  return o;
+}
+
+static void record(const char *name, int64_t us) {
+  op_t *o = op(name);
+  if (us < 0) {
+    o->timeouts++;
+    return;
+  }
+
+  if (o->count == o->capacity) {
+    o->capacity = o->capacity ? o->capacity * 2 : 256;
+    o->samples = realloc(o->samples, sizeof(uint64_t) * o->capacity);
+    if (!o->samples) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  o->samples[o->count++] = us;
+}
+
+static xcb_atom_t intern(const char *name) {
+  xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(conn, xcb_intern_atom(conn, 0, strlen(name), name), NULL);
+  xcb_atom_t atom = r ? r->atom : XCB_NONE;
+  free(r);
+  return atom;
+}
+
+static xcb_window_t active_window() {
+  xcb_get_property_reply_t *r = xcb_get_property_reply(conn, xcb_get_property(conn, 0, screen->root, atom_net_active_window, XCB_ATOM_WINDOW, 0, 1), NULL);
+  xcb_window_t window = XCB_WINDOW_NONE;
+  if (r && xcb_get_property_value_length(r) >= 4)
+    window = *(xcb_window_t *)xcb_get_property_value(r);
+  free(r);
+  return window;
+}
+
+static int event_matches(xcb_generic_event_t *ev, const expect_t *e) {
+  uint8_t type = ev->response_type & ~0x80;
+
+  if (type == XCB_PROPERTY_NOTIFY) {
+    xcb_property_notify_event_t *pn = (xcb_property_notify_event_t *)ev;
+    if (pn->window == screen->root && pn->atom == atom_net_active_window) {
+      if (e->kind == EXPECT_ACTIVE_CHANGED)
+        return 1;
+      if (e->kind == EXPECT_ACTIVE_WINDOW)
+        return active_window() == e->window;
+    }
+    return e->kind == EXPECT_WM_STATE && pn->window == e->window && pn->atom == atom_net_wm_state;
+  }
+
+  if (type == XCB_FOCUS_IN)
+    return e->kind == EXPECT_FOCUS_IN && ((xcb_focus_in_event_t *)ev)->event == e->window;
+
+  if (type == XCB_CLIENT_MESSAGE) {
+    xcb_client_message_event_t *cm = (xcb_client_message_event_t *)ev;
+    if (e->kind != EXPECT_SYNC_REQUEST || cm->window != e->window || cm->type != atom_wm_protocols ||
+        cm->data.data32[0] != atom_net_wm_sync_request)
+      return 0;
+    sync_request_value = ((uint64_t)cm->data.data32[3] << 32) | cm->data.data32[2];
+    return 1;
+  }
+
+  if (type == XCB_CONFIGURE_NOTIFY) {
+    xcb_configure_notify_event_t *cn = (xcb_configure_notify_event_t *)ev;
+    if (cn->window != e->window)
+      return 0;
+    if (e->kind == EXPECT_CONFIGURE_WIDTH)
+      return cn->width == e->value;
+    if (e->kind == EXPECT_CONFIGURE_X)
+      return cn->x == e->value;
+    if (e->kind == EXPECT_CONFIGURE_X_BELOW)
+      return cn->x < e->value;
+  }
+
+  return 0;
+}
+
+static int64_t wait_for(expect_t e, uint64_t start) {
+  uint64_t deadline = start + WAIT_TIMEOUT_MS * 1000;
+  int remaining = e.count > 0 ? e.count : 1;
+
+  for (;;) {
+    xcb_generic_event_t *ev;
+    while ((ev = xcb_poll_for_event(conn))) {
+      uint64_t t = now_us();
+      int hit = event_matches(ev, &e);
+      free(ev);
+      if (hit && --remaining == 0)
+        return t - start;
+    }
+
+    if (xcb_connection_has_error(conn))
+      return -1;
+
+    uint64_t now = now_us();
+    if (now >= deadline)
+      return -1;
+
+    struct pollfd fd = { .fd = xcb_get_file_descriptor(conn), .events = POLLIN };
+    poll(&fd, 1, (deadline - now + 999) / 1000);
+  }
+}
+
+static void drain() {
+  free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+  xcb_generic_event_t *ev;
+  while ((ev = xcb_poll_for_event(conn)))
+    free(ev);
+}
+
+static xcb_window_t create_window(int x, int y, int width, int height) {
+  xcb_window_t window = xcb_generate_id(conn);
+  uint32_t values[] = { screen->black_pixel, XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE };
+  xcb_create_window(conn, XCB_COPY_FROM_PARENT, window, screen->root, x, y, width, height, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, values);
+  return window;
+}
+
+static int64_t map_and_wait(xcb_window_t window) {
+  uint64_t start = now_us();
+  xcb_map_window(conn, window);
+  xcb_flush(conn);
+  return wait_for((expect_t){ EXPECT_ACTIVE_WINDOW, window, 0, 1 }, start);
+}
+
+static void send_client_message(xcb_window_t window, xcb_atom_t type, uint32_t d0, uint32_t d1, uint32_t d2) {
+  xcb_client_message_event_t cm;
+  memset(&cm, 0, sizeof(cm));
+  cm.response_type = XCB_CLIENT_MESSAGE;
+  cm.format = 32;
+  cm.window = window;
+  cm.type = type;
+  cm.data.data32[0] = d0;
+  cm.data.data32[1] = d1;
+  cm.data.data32[2] = d2;
+  cm.data.data32[3] = 1;
+  xcb_send_event(conn, 0, screen->root, XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY, (const char *)&cm);
+}
+
+static void run_phase(const char *name, void (*step)(int, int), int count) {
+  for (int i = 0; i < WARMUP_ITERATIONS; i++)
+    step(i, 0);
+  drain();
+
+  double cpu_start = wm_cpu_us();
+  for (int i = 0; i < count; i++)
+    step(i, 1);
+  drain();
+  double cpu_end = wm_cpu_us();
+
+  phase_t *p = &phases[phase_count++];
+  p->name = name;
+  p->iterations = count;
+  p->wm_cpu_us = count > 0 ? (cpu_end - cpu_start) / count : 0;
+}
+
+static void step_map_destroy(int i, int measure) {
+  (void)i;
+  xcb_window_t window = create_window(100, 100, 400, 300);
+  uint64_t map_start = now_us();
+  xcb_map_window(conn, window);
+  xcb_flush(conn);
+  int64_t focus_us = wait_for((expect_t){ EXPECT_FOCUS_IN, window, 0, 1 }, map_start);
+  int64_t map_us = wait_for((expect_t){ EXPECT_ACTIVE_WINDOW, window, 0, 1 }, map_start);
+
+  uint64_t start = now_us();
+  xcb_destroy_window(conn, window);
+  xcb_flush(conn);
+  int64_t destroy_us = wait_for((expect_t){ EXPECT_ACTIVE_CHANGED, window, 0, 1 }, start);
+
+  if (measure) {
+    record("map -> focus in", focus_us);
+    record("map -> active", map_us);
+    record("destroy -> active changed", destroy_us);
+  }
+}
+
+static xcb_window_t window_a, window_b, probe;
+
+static void step_state_toggle(xcb_atom_t state, const char *name, int measure) {
+  for (int k = 0; k < 2; k++) {
+    uint64_t start = now_us();
+    send_client_message(window_a, atom_net_wm_state, 2, state, 0);
+    xcb_flush(conn);
+    int64_t us = wait_for((expect_t){ EXPECT_WM_STATE, window_a, 0, 1 }, start);
+    if (measure)
+      record(name, us);
+  }
+}
+
+static void step_fullscreen(int i, int measure) {
+  (void)i;
+  step_state_toggle(atom_net_wm_state_fullscreen, "fullscreen toggle", measure);
+}
+
+static void step_above(int i, int measure) {
+  (void)i;
+  step_state_toggle(atom_net_wm_state_above, "above toggle", measure);
+}
+
+static void step_state_flood(int i, int measure) {
+  int n = burst & ~1;
+  xcb_atom_t state = (i & 1) ? atom_net_wm_state_above : atom_net_wm_state_fullscreen;
+
+  uint64_t start = now_us();
+  for (int k = 0; k < n; k++)
+    send_client_message(window_a, atom_net_wm_state, 2, state, 0);
+  xcb_flush(conn);
+  int64_t us = wait_for((expect_t){ EXPECT_WM_STATE, window_a, 0, n }, start);
+  if (measure)
+    record("state flood (burst)", us);
+}
+
+static void step_activate(int i, int measure) {
+  xcb_window_t target = (i & 1) ? window_a : window_b;
+
+  uint64_t start = now_us();
+  send_client_message(target, atom_net_active_window, 2, XCB_CURRENT_TIME, 0);
+  xcb_flush(conn);
+  int64_t us = wait_for((expect_t){ EXPECT_ACTIVE_WINDOW, target, 0, 1 }, start);
+  if (measure)
+    record("_NET_ACTIVE_WINDOW -> active", us);
+}
+
+static void step_configure_burst(int i, int measure) {
+  int base = (i & 1) ? 600 : 300;
+  int final_width = base + burst - 1;
+
+  uint64_t start = now_us();
+  for (int k = 0; k < burst; k++) {
+    uint32_t values[] = { 120 + k, 120 + k, base + k, 300 };
+    xcb_configure_window(conn, window_a, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+  }
+  xcb_flush(conn);
+  int64_t us = wait_for((expect_t){ EXPECT_CONFIGURE_WIDTH, window_a, final_width, 1 }, start);
+  if (measure)
+    record("configure burst -> final", us);
+}
+
+static int set_screen(xcb_randr_mode_t mode, uint16_t width, uint16_t height) {
+  uint32_t mm_width = (uint64_t)full_mm_width * width / full_width;
+  uint32_t mm_height = (uint64_t)full_mm_height * height / full_height;
+  int growing = mode == randr_full_mode;
+
+  if (growing)
+    free(xcb_request_check(conn, xcb_randr_set_screen_size_checked(conn, screen->root, width, height, mm_width, mm_height)));
+
+  xcb_randr_set_crtc_config_reply_t *r = xcb_randr_set_crtc_config_reply(conn,
+    xcb_randr_set_crtc_config(conn, randr_crtc, XCB_CURRENT_TIME, randr_config_timestamp, 0, 0, mode, XCB_RANDR_ROTATION_ROTATE_0, 1, &randr_output), NULL);
+  int ok = r && r->status == 0;
+  free(r);
+
+  if (!growing)
+    free(xcb_request_check(conn, xcb_randr_set_screen_size_checked(conn, screen->root, width, height, mm_width, mm_height)));
+
+  return ok ? 0 : -1;
+}
+
+static int setup_randr() {
+  xcb_randr_get_screen_resources_current_reply_t *res = xcb_randr_get_screen_resources_current_reply(conn, xcb_randr_get_screen_resources_current(conn, screen->root), NULL);
+  if (!res || xcb_randr_get_screen_resources_current_crtcs_length(res) < 1 || xcb_randr_get_screen_resources_current_outputs_length(res) < 1) {
+    free(res);
+    return -1;
+  }
+
+  randr_crtc = xcb_randr_get_screen_resources_current_crtcs(res)[0];
+  randr_output = xcb_randr_get_screen_resources_current_outputs(res)[0];
+  randr_config_timestamp = res->config_timestamp;
+  free(res);
+
+  xcb_randr_get_crtc_info_reply_t *crtc = xcb_randr_get_crtc_info_reply(conn, xcb_randr_get_crtc_info(conn, randr_crtc, XCB_CURRENT_TIME), NULL);
+  if (!crtc || crtc->mode == XCB_NONE) {
+    free(crtc);
+    return -1;
+  }
+  randr_full_mode = crtc->mode;
+  free(crtc);
+
+  full_width = screen->width_in_pixels;
+  full_height = screen->height_in_pixels;
+  full_mm_width = screen->width_in_millimeters;
+  full_mm_height = screen->height_in_millimeters;
+
+  const char *name = "sinwm-bench";
+  xcb_randr_mode_info_t info;
+  memset(&info, 0, sizeof(info));
+  info.width = SHRUNK_WIDTH;
+  info.height = SHRUNK_HEIGHT;
+  info.htotal = SHRUNK_WIDTH;
+  info.vtotal = SHRUNK_HEIGHT;
+  info.dot_clock = SHRUNK_WIDTH * SHRUNK_HEIGHT * 60;
+  info.name_len = strlen(name);
+
+  xcb_randr_create_mode_reply_t *mode = xcb_randr_create_mode_reply(conn, xcb_randr_create_mode(conn, screen->root, info, strlen(name), name), NULL);
+  if (!mode)
+    return -1;
+  randr_shrunk_mode = mode->mode;
+  free(mode);
+
+  xcb_randr_add_output_mode(conn, randr_output, randr_shrunk_mode);
+  return 0;
+}
+
+static void step_resize(int i, int measure) {
+  (void)i;
+  uint64_t start = now_us();
+  if (set_screen(randr_shrunk_mode, SHRUNK_WIDTH, SHRUNK_HEIGHT) != 0) {
+    if (measure)
+      record("screen shrink -> window moved", -1);
+    return;
+  }
+  xcb_flush(conn);
+  int64_t us = wait_for((expect_t){ EXPECT_CONFIGURE_X_BELOW, probe, SHRUNK_WIDTH, 1 }, start);
+  if (measure)
+    record("screen shrink -> window moved", us);
+
+  set_screen(randr_full_mode, full_width, full_height);
+  drain();
+
+  uint32_t x = PROBE_X;
+  start = now_us();
+  xcb_configure_window(conn, probe, XCB_CONFIG_WINDOW_X, &x);
+  xcb_flush(conn);
+  wait_for((expect_t){ EXPECT_CONFIGURE_X, probe, PROBE_X, 1 }, start);
+}
+
+// The counter starts above zero, as for a client that has been resized
+// before, so a sync request that was not seeded from it stands out.
+static int setup_sync() {
+  xcb_sync_initialize_reply_t *init = xcb_sync_initialize_reply(conn, xcb_sync_initialize(conn, 3, 1), NULL);
+  if (!init)
+    return -1;
+  free(init);
+
+  sync_counter = xcb_generate_id(conn);
+  xcb_sync_create_counter(conn, sync_counter, (xcb_sync_int64_t){ 0, SYNC_COUNTER_START });
+
+  sync_window = create_window(160, 160, 300, 300);
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, sync_window, atom_wm_protocols, XCB_ATOM_ATOM, 32, 1, &atom_net_wm_sync_request);
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, sync_window, atom_net_wm_sync_request_counter, XCB_ATOM_CARDINAL, 32, 1, &sync_counter);
+  return map_and_wait(sync_window) < 0 ? -1 : 0;
+}
+
+static void step_sync_resize(int i, int measure) {
+  (void)i;
+  uint64_t start = now_us();
+  send_client_message(sync_window, atom_net_wm_state, 2, atom_net_wm_state_fullscreen, 0);
+  xcb_flush(conn);
+  int64_t us = wait_for((expect_t){ EXPECT_SYNC_REQUEST, sync_window, 0, 1 }, start);
+  if (us >= 0 && sync_request_value <= sync_counter_value) {
+    sync_unseeded++;
+    us = -1;
+  }
+  if (measure)
+    record("fullscreen -> sync request", us);
+  if (sync_request_value <= sync_counter_value)
+    return;
+
+  sync_counter_value = sync_request_value;
+  xcb_sync_set_counter(conn, sync_counter, (xcb_sync_int64_t){ (int32_t)(sync_counter_value >> 32), (uint32_t)sync_counter_value });
+  xcb_flush(conn);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report() {
+  printf("%-32s %8s %10s %10s %10s %9s\n", "op", "n", "p50_us", "p99_us", "max_us", "timeouts");
+  for (int i = 0; i < op_count; i++) {
+    op_t *o = &ops[i];
+    if (o->count == 0) {
+      printf("%-32s %8d %10s %10s %10s %9d\n", o->name, 0, "-", "-", "-", o->timeouts);
+      continue;
+    }
+
+    qsort(o->samples, o->count, sizeof(uint64_t), cmp_u64);
+    printf("%-32s %8d %10llu %10llu %10llu %9d\n",
+      o->name,
+      o->count,
+      (unsigned long long)o->samples[(o->count - 1) / 2],
+      (unsigned long long)o->samples[(int)((o->count - 1) * 0.99)],
+      (unsigned long long)o->samples[o->count - 1],
+      o->timeouts);
+  }
+
+  printf("\n%-32s %10s %16s\n", "phase", "iterations", "wm_cpu_us/iter");
+  for (int i = 0; i < phase_count; i++)
+    printf("%-32s %10d %16.1f\n", phases[i].name, phases[i].iterations, phases[i].wm_cpu_us);
+}
+
+// Maps count windows, every tenth one fullscreen, and keeps them until
+// killed, so run.sh can restart the window manager underneath them.
+static void hold_windows(int count) {
+  for (int i = 0; i < count; i++) {
+    xcb_window_t window = create_window(40 + (i % 20) * 20, 40 + (i / 20) * 20, 320, 240);
+    map_and_wait(window);
+    if (i % 10 == 0) {
+      uint64_t start = now_us();
+      send_client_message(window, atom_net_wm_state, 1, atom_net_wm_state_fullscreen, 0);
+      xcb_flush(conn);
+      wait_for((expect_t){ EXPECT_WM_STATE, window, 0, 1 }, start);
+    }
+  }
+  drain();
+
+  printf("holding %d windows\n", count);
+  fflush(stdout);
+  for (;;)
+    pause();
+}
+
+static int wait_for_wm() {
+  for (int i = 0; i < 500; i++) {
+    xcb_get_property_reply_t *r = xcb_get_property_reply(conn, xcb_get_property(conn, 0, screen->root, atom_net_supporting_wm_check, XCB_ATOM_WINDOW, 0, 1), NULL);
+    int found = r && xcb_get_property_value_length(r) >= 4;
+    free(r);
+    if (found)
+      return 0;
+    usleep(10000);
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:p:H:")) != -1) {
+    if (opt == 'n') iterations = atoi(optarg);
+    else if (opt == 'b') burst = atoi(optarg);
+    else if (opt == 'p') wm_pid = atoi(optarg);
+    else if (opt == 'H') hold = atoi(optarg);
+    else {
+      fprintf(stderr, "Usage: %s [-n iterations] [-b burst] [-p wm_pid] [-H windows]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (iterations < 1 || burst < 2) {
+    fprintf(stderr, "Iterations must be positive and burst at least 2\n");
+    return 1;
+  }
+
+  conn = xcb_connect(NULL, NULL);
+  if (xcb_connection_has_error(conn)) {
+    fprintf(stderr, "Unable to connect to the X server\n");
+    return 1;
+  }
+  screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+
+  atom_net_active_window = intern("_NET_ACTIVE_WINDOW");
+  atom_net_wm_state = intern("_NET_WM_STATE");
+  atom_net_wm_state_fullscreen = intern("_NET_WM_STATE_FULLSCREEN");
+  atom_net_wm_state_above = intern("_NET_WM_STATE_ABOVE");
+  atom_net_supporting_wm_check = intern("_NET_SUPPORTING_WM_CHECK");
+  atom_wm_protocols = intern("WM_PROTOCOLS");
+  atom_net_wm_sync_request = intern("_NET_WM_SYNC_REQUEST");
+  atom_net_wm_sync_request_counter = intern("_NET_WM_SYNC_REQUEST_COUNTER");
+
+  if (wait_for_wm() != 0) {
+    fprintf(stderr, "No window manager appeared on the display\n");
+    return 1;
+  }
+
+  uint32_t root_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+  xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK, &root_mask);
+  drain();
+
+  if (hold > 0)
+    hold_windows(hold);
+
+  run_phase("map+destroy", step_map_destroy, iterations);
+
+  window_a = create_window(120, 120, 300, 300);
+  window_b = create_window(200, 200, 300, 300);
+  map_and_wait(window_a);
+  map_and_wait(window_b);
+  drain();
+
+  run_phase("fullscreen toggle", step_fullscreen, iterations);
+  run_phase("above toggle", step_above, iterations);
+  run_phase("state flood", step_state_flood, iterations);
+  run_phase("activate", step_activate, iterations);
+  run_phase("configure burst", step_configure_burst, iterations);
+
+  if (setup_sync() == 0) {
+    drain();
+    run_phase("sync resize", step_sync_resize, iterations);
+    if (sync_unseeded > 0)
+      fprintf(stderr, "%d sync requests were not above the client's counter\n", sync_unseeded);
+  } else {
+    fprintf(stderr, "Sync setup failed, skipping sync resize\n");
+  }
+
+  if (setup_randr() == 0) {
+    probe = create_window(PROBE_X, 100, 200, 200);
+    map_and_wait(probe);
+    drain();
+    run_phase("screen resize", step_resize, iterations);
+    set_screen(randr_full_mode, full_width, full_height);
+  } else {
+    fprintf(stderr, "RandR mode setup failed, skipping screen resize\n");
+  }
+
+  report();
+
+  xcb_disconnect(conn);
+  return 0;
+}
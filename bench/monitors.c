@@ -0,0 +1,120 @@
+/* Times a CRTC rotation patched into the monitor table in place against a
+ * full RandR enumeration of the same layout. The enumeration needs an X
+ * server; without one only the patch is timed, on a six-head wall. */
+
+#include "bench.h"
+
+#define ROTATIONS 1000000
+#define ENUMERATIONS 1000
+#define HEADS 6
+
+typedef struct {
+  xcb_connection_t *conn;
+  xcb_screen_t *screen;
+} display_t;
+
+static void setup_wall() {
+  monitor_count = HEADS;
+  ewmh_index_count = HEADS;
+  for (int i = 0; i < HEADS; i++) {
+    monitor_t *m = &monitors[i];
+    memset(m, 0, sizeof(*m));
+    m->crtc = 0x40 + i;
+    m->output = 0x80 + i;
+    m->x = (i % 3) * 1920;
+    m->y = (i / 3) * 1080;
+    m->width = 1920;
+    m->height = 1080;
+    m->rotation = XCB_RANDR_ROTATION_ROTATE_0;
+    m->ewmh_index = i;
+    m->outputs = 1;
+    snprintf(m->output_name, sizeof(m->output_name), "DP-%d", i + 1);
+  }
+  refresh_patched_monitors(NULL);
+}
+
+static int open_display(display_t *d) {
+  d->conn = xcb_connect(NULL, NULL);
+  if (xcb_connection_has_error(d->conn)) {
+    xcb_disconnect(d->conn);
+    d->conn = NULL;
+    return -1;
+  }
+  d->screen = xcb_setup_roots_iterator(xcb_get_setup(d->conn)).data;
+
+  xcb_randr_query_version_reply_t *version = xcb_randr_query_version_reply(d->conn, xcb_randr_query_version(d->conn, 1, 5), NULL);
+  if (!version) {
+    xcb_disconnect(d->conn);
+    d->conn = NULL;
+    return -1;
+  }
+  randr_has_monitors = version->major_version > 1 || (version->major_version == 1 && version->minor_version >= 5);
+  free(version);
+  return 0;
+}
+
+static void enumerate_step(void *arg, int i) {
+  (void)i;
+  display_t *d = arg;
+  query_xrandr(d->conn, d->screen);
+}
+
+static void rotate_step(void *arg, int i) {
+  display_t *d = arg;
+  monitor_t *m = &monitors[0];
+  xcb_randr_crtc_change_t cc;
+  memset(&cc, 0, sizeof(cc));
+  cc.crtc = m->crtc;
+  cc.mode = 1;
+  cc.x = m->x;
+  cc.y = m->y;
+  cc.rotation = i & 1 ? XCB_RANDR_ROTATION_ROTATE_0 : XCB_RANDR_ROTATION_ROTATE_90;
+  cc.width = i & 1 ? m->height : m->width;
+  cc.height = i & 1 ? m->width : m->height;
+  if (!patch_monitor_crtc(&cc)) {
+    fprintf(stderr, "Rotation was not patched in place\n");
+    exit(1);
+  }
+  refresh_patched_monitors(d->conn);
+}
+
+// query_xrandr reports the screen size on stderr every time it runs.
+static double time_enumeration(display_t *d) {
+  int saved = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (null >= 0)
+    dup2(null, STDERR_FILENO);
+  double ns = bench_time_ns(enumerate_step, d, ENUMERATIONS, 1);
+  if (saved >= 0)
+    dup2(saved, STDERR_FILENO);
+  close(null);
+  close(saved);
+  return ns;
+}
+
+int main() {
+  display_t d = { 0 };
+  double enumerate_ns = NAN;
+  if (open_display(&d) == 0) {
+    enumerate_ns = time_enumeration(&d);
+    if (monitor_count == 0 || monitors[0].crtc == XCB_NONE || monitors[0].outputs != 1) {
+      xcb_disconnect(d.conn);
+      d.conn = NULL;
+      enumerate_ns = NAN;
+    }
+  }
+  if (!d.conn)
+    setup_wall();
+
+  char label[16];
+  snprintf(label, sizeof(label), "%d", monitor_count);
+  double rotate_ns = bench_time_ns(rotate_step, &d, d.conn ? ENUMERATIONS : ROTATIONS, 1);
+
+  const char *columns[] = { "rotate_ns", "enumerate_ns" };
+  bench_header("heads", columns, 2);
+  bench_row(label, (double[]){ rotate_ns, enumerate_ns }, 2);
+
+  if (d.conn)
+    xcb_disconnect(d.conn);
+  return 0;
+}
@@ -0,0 +1,99 @@
+#!/bin/sh
+# Runs sinwm against a private Xvfb and drives it with bench/loadgen.
+# Usage: bench/run.sh [loadgen options], e.g. bench/run.sh -n 500 -b 64
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+DISPLAY_NUMBER=${BENCH_DISPLAY:-99}
+while [ -e "/tmp/.X11-unix/X$DISPLAY_NUMBER" ] || [ -e "/tmp/.X$DISPLAY_NUMBER-lock" ]; do
+  DISPLAY_NUMBER=$((DISPLAY_NUMBER + 1))
+done
+export DISPLAY=":$DISPLAY_NUMBER"
+
+WORK=$(mktemp -d)
+XVFB_PID=
+WM_PID=
+HOLD_PID=
+HOLD_WINDOWS=${BENCH_HOLD_WINDOWS:-100}
+
+cleanup() {
+  [ -n "$HOLD_PID" ] && kill "$HOLD_PID" 2>/dev/null || true
+  [ -n "$WM_PID" ] && kill "$WM_PID" 2>/dev/null || true
+  [ -n "$XVFB_PID" ] && kill "$XVFB_PID" 2>/dev/null || true
+  wait 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# Pin the server, the window manager and the load generator to separate CPUs
+# when possible so runs are comparable.
+PIN0= PIN1= PIN2=
+if command -v taskset >/dev/null 2>&1 && [ "$(nproc)" -ge 3 ]; then
+  PIN0="taskset -c 0" PIN1="taskset -c 1" PIN2="taskset -c 2"
+fi
+
+$PIN0 Xvfb "$DISPLAY" -screen 0 1920x1080x24 +extension RANDR -nolisten tcp -noreset >"$WORK/xvfb.log" 2>&1 &
+XVFB_PID=$!
+
+# wait_for_line <file> <text>: waits up to 5 s for text to show up in file.
+wait_for_line() {
+  i=0
+  until grep -q "$2" "$1" 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -gt 100 ] && return 1
+    sleep 0.05
+  done
+}
+
+i=0
+until [ -e "/tmp/.X11-unix/X$DISPLAY_NUMBER" ]; do
+  i=$((i + 1))
+  if [ $i -gt 100 ]; then
+    echo "Xvfb did not start:" >&2
+    cat "$WORK/xvfb.log" >&2
+    exit 1
+  fi
+  sleep 0.05
+done
+
+# A private HOME keeps the user's wallpaper and touch config out of the run.
+start_wm() {
+  $PIN1 env HOME="$WORK" XDG_CACHE_HOME="$WORK/cache" XDG_RUNTIME_DIR="$WORK" \
+    ./sinwm "$@" >>"$WORK/sinwm.log" 2>&1 &
+  WM_PID=$!
+}
+
+# The monitor bench needs the server but no window manager.
+$PIN2 ./bench/monitors
+echo
+
+start_wm
+
+$PIN2 ./bench/loadgen -p "$WM_PID" "$@"
+
+kill -USR1 "$WM_PID"
+sleep 0.2
+echo
+cat "$WORK/sinwm-metrics" 2>/dev/null || echo "sinwm wrote no metrics"
+
+# Restart underneath $HOLD_WINDOWS mapped windows. The old instance is killed
+# without a chance to clean up, as in a crash.
+$PIN2 ./bench/loadgen -H "$HOLD_WINDOWS" >"$WORK/hold.log" 2>&1 &
+HOLD_PID=$!
+if ! wait_for_line "$WORK/hold.log" holding; then
+  echo "Load generator did not map its windows:" >&2
+  cat "$WORK/hold.log" >&2
+  exit 1
+fi
+
+kill -KILL "$WM_PID"
+wait "$WM_PID" 2>/dev/null || true
+: >"$WORK/sinwm.log"
+start_wm --profile-startup
+wait_for_line "$WORK/sinwm.log" "managing windows" || true
+
+echo
+echo "Restart with $HOLD_WINDOWS windows:"
+grep '^startup' "$WORK/sinwm.log" || echo "sinwm printed no startup profile"
@@ -0,0 +1,122 @@
+/* Times fullscreen and always-on-top lookups in the window tables against
+ * the fixed-array layout they replaced, at 10, 1k and 10k windows. */
+
+#include "bench.h"
+
+#define LOOKUPS 2000000
+#define LEGACY_OUTPUT_NAME_MAX 64
+
+typedef struct {
+  xcb_window_t window;
+  xcb_rectangle_t original_geometry;
+  char monitor_output_names[4][LEGACY_OUTPUT_NAME_MAX];
+  int has_monitors;
+  int is_general_fullscreen;
+  int is_monitor_fullscreen;
+} legacy_fullscreen_window_t;
+
+static legacy_fullscreen_window_t *legacy_fs_windows;
+static xcb_window_t *legacy_always_on_top_windows;
+static int legacy_count;
+
+static int legacy_is_fullscreen_window(xcb_window_t window) {
+  for (int i = 0; i < legacy_count; i++) {
+    if (legacy_fs_windows[i].window == window)
+      return 1;
+  }
+  return 0;
+}
+
+static int legacy_is_always_on_top(xcb_window_t window) {
+  for (int i = 0; i < legacy_count; i++) {
+    if (legacy_always_on_top_windows[i] == window)
+      return 1;
+  }
+  return 0;
+}
+
+static xcb_window_t window_id(int i) {
+  return 0x00400001 + i * 3;
+}
+
+static xcb_window_t probe_window(uint32_t *seed, int n) {
+  *seed = *seed * 1103515245 + 12345;
+  int i = (*seed >> 8) % (n * 2);
+  return window_id(i);
+}
+
+typedef struct {
+  int (*lookup)(xcb_window_t);
+  int n;
+  uint32_t seed;
+  int hits;
+} lookup_run_t;
+
+static void lookup_step(void *arg, int i) {
+  (void)i;
+  lookup_run_t *r = arg;
+  r->hits += r->lookup(probe_window(&r->seed, r->n));
+}
+
+static double time_lookups(int (*lookup)(xcb_window_t), int n, int *hits) {
+  lookup_run_t r = { lookup, n, 1, 0 };
+  double ns = bench_time_ns(lookup_step, &r, LOOKUPS, 1);
+  *hits = r.hits;
+  return ns;
+}
+
+static void run(int n) {
+  legacy_fs_windows = calloc(n, sizeof(*legacy_fs_windows));
+  legacy_always_on_top_windows = calloc(n, sizeof(*legacy_always_on_top_windows));
+  legacy_count = n;
+
+  xcb_rectangle_t geometry = { 0, 0, 640, 480 };
+  uint64_t start = now_us();
+  for (int i = 0; i < n; i++) {
+    track_fullscreen_window(window_id(i), &geometry);
+    add_to_always_on_top(window_id(i));
+  }
+  double insert_ns = (now_us() - start) * 1000.0 / n;
+
+  for (int i = 0; i < n; i++) {
+    legacy_fs_windows[i].window = window_id(i);
+    legacy_fs_windows[i].original_geometry = geometry;
+    legacy_always_on_top_windows[i] = window_id(i);
+  }
+
+  int hits_legacy_fs, hits_legacy_top, hits_fs, hits_top;
+  double legacy_fs = time_lookups(legacy_is_fullscreen_window, n, &hits_legacy_fs);
+  double legacy_top = time_lookups(legacy_is_always_on_top, n, &hits_legacy_top);
+  double fs = time_lookups(is_fullscreen_window, n, &hits_fs);
+  double top = time_lookups(is_always_on_top, n, &hits_top);
+
+  if (hits_fs != hits_legacy_fs || hits_top != hits_legacy_top)
+    fprintf(stderr, "Lookup mismatch at %d windows\n", n);
+
+  char label[16];
+  snprintf(label, sizeof(label), "%d", n);
+  double row[] = { legacy_fs, fs, legacy_top, top, insert_ns };
+  bench_row(label, row, 5);
+
+  while (fullscreen_count > 0)
+    untrack_fullscreen_window(fullscreen_count - 1);
+  for (int i = 0; i < n; i++) {
+    remove_from_always_on_top(window_id(i));
+    remove_client(window_id(i));
+  }
+  free(legacy_fs_windows);
+  free(legacy_always_on_top_windows);
+}
+
+int main() {
+  printf("fullscreen entry: legacy %zu B, hot %zu B\n",
+    sizeof(legacy_fullscreen_window_t), sizeof(fullscreen_window_t));
+  const char *columns[] = { "legacy_fs_ns", "fs_ns", "legacy_top_ns", "top_ns", "insert_ns" };
+  bench_header("windows", columns, 5);
+
+  int sizes[] = { 10, 1000, 10000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    run(sizes[i]);
+
+  return 0;
+}
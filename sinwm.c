@@ -1,19 +1,87 @@
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/randr.h>
 #include <xcb/xinerama.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xinput.h>
+#include <xcb/sync.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
 #include <png.h>
 
-#define MAX_WINDOWS 128
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SINWM_X86 1
+#endif
+
 #define MAX_MONITORS 32
 #define OUTPUT_NAME_MAX 64
+#define CLIENT_BUCKETS 256
+#define WALLPAPER_STRIP_ROWS 64
+#define MAX_DAMAGE_RECTS 64
+#define WALLPAPER_CACHE_MAGIC "SINWMWP1"
+#define WALLPAPER_CACHE_MAX_BYTES (256ULL * 1024 * 1024)
+#define METRIC_BUCKETS 24
+#define MAX_CLIENT_MESSAGE_METRICS 16
+#define MAX_BATCH_EVENTS 256
+#define MAX_BATCH_US 8000
+
+#define WAIT_REPLY(...) ({ \
+  uint64_t reply_start_ = now_us(); \
+  __typeof__(__VA_ARGS__) reply_ = (__VA_ARGS__); \
+  metrics_reply_wait(reply_start_); \
+  reply_; \
+})
+
+#define CLIENT_DOCK              (1 << 0)
+#define CLIENT_SPLASH            (1 << 1)
+#define CLIENT_OVERRIDE_REDIRECT (1 << 2)
+#define CLIENT_DELETE_WINDOW     (1 << 3)
+#define CLIENT_FULLSCREEN        (1 << 4)
+#define CLIENT_ABOVE             (1 << 5)
+#define CLIENT_ON_TOP_LIST       (1 << 6)
+#define CLIENT_FULLSCREEN_LIST   (1 << 7)
+#define CLIENT_FOCUS_LIST        (1 << 8)
+#define CLIENT_HAS_GEOMETRY      (1 << 9)
+#define CLIENT_STACKED           (1 << 10)
+#define CLIENT_MAPPED            (1 << 11)
+#define CLIENT_SYNC_REQUEST      (1 << 12)
+#define CLIENT_SYNC_WAITING      (1 << 13)
+#define CLIENT_SYNC_PENDING      (1 << 14)
+#define CLIENT_SYNC_SEEDED       (1 << 15)
+
+#define FULLSCREEN_GENERAL      (1 << 0)
+#define FULLSCREEN_MONITOR      (1 << 1)
+#define FULLSCREEN_HAS_MONITORS (1 << 2)
+
+#define WM_STATE_VERSION 1
+#define WM_STATE_HEADER_WORDS 3
+#define WM_STATE_RECORD_WORDS 6
+
+enum {
+  LAYER_NORMAL,
+  LAYER_ABOVE,
+  LAYER_FULLSCREEN,
+  LAYER_DOCK
+};
+
+#define SOURCE_ATTRIBUTES (1 << 0)
+#define SOURCE_TYPE       (1 << 1)
+#define SOURCE_PROTOCOLS  (1 << 2)
+#define SOURCE_STATE      (1 << 3)
+#define SOURCE_ALL        (SOURCE_ATTRIBUTES | SOURCE_TYPE | SOURCE_PROTOCOLS | SOURCE_STATE)
 
 static xcb_atom_t
     atom_net_wm_state
@@ -34,12 +102,19 @@ static xcb_atom_t
   , atom_wm_protocols
   , atom_wm_delete_window
   , atom_coordinate_transformation_matrix
-  , atom_float;
+  , atom_float
+  , atom_xrootpmap_id
+  , atom_esetroot_pmap_id
+  , atom_net_client_list_stacking
+  , atom_net_wm_sync_request
+  , atom_net_wm_sync_request_counter
+  , atom_sinwm_state;
 
 static xcb_pixmap_t pixmap = XCB_PIXMAP_NONE;
-static xcb_window_t always_on_top_windows[MAX_WINDOWS];
+static xcb_window_t *always_on_top_windows = NULL;
 static xcb_window_t wm_support_window = XCB_WINDOW_NONE;
 static int always_on_top_count = 0;
+static int always_on_top_capacity = 0;
 static const float m0[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
 static const float m90[9] = { 0, -1, 1, 1, 0, 0, 0, 0, 1 };
 static const float m180[9] = { -1, 0, 1, 0, -1, 1, 0, 0, 1 };
@@ -47,33 +122,48 @@ static const float m270[9] = { 0, 1, 0, -1, 0, 1, 0, 0, 1 };
 
 typedef struct {
   xcb_window_t window;
-  xcb_rectangle_t original_geometry;
-  char monitor_output_names[4][OUTPUT_NAME_MAX];
-  int has_monitors;
-  int is_general_fullscreen;
-  int is_monitor_fullscreen;
+  uint32_t flags;
 } fullscreen_window_t;
 
-static fullscreen_window_t fs_windows[MAX_WINDOWS];
+typedef struct {
+  xcb_rectangle_t original_geometry;
+  uint16_t monitor_names[4];
+} fullscreen_geometry_t;
+
+static fullscreen_window_t *fs_windows = NULL;
+static fullscreen_geometry_t *fs_geometry = NULL;
 static int fullscreen_count = 0;
+static int fullscreen_capacity = 0;
+
+static char (*output_names)[OUTPUT_NAME_MAX] = NULL;
+static int output_name_count = 0;
+static int output_name_capacity = 0;
 static xcb_window_t active_window = XCB_WINDOW_NONE;
 
 typedef struct {
   xcb_randr_crtc_t crtc;
   xcb_randr_output_t output;
   char output_name[OUTPUT_NAME_MAX];
+  uint16_t name_id;
   int x;
   int y;
   int width;
   int height;
   int rotation;
+  int ewmh_index;
+  int outputs;
 } monitor_t;
 
 static monitor_t monitors[MAX_MONITORS];
 static int monitor_count = 0;
 
+static xcb_randr_output_t primary_output = XCB_NONE;
+static int primary_output_valid = 0;
+static int primary_monitor = -1;
+
 static int ewmh_index_to_monitor[MAX_MONITORS];
 static int ewmh_index_count = 0;
+static int randr_has_monitors = 0;
 
 static monitor_t previous_monitors[MAX_MONITORS];
 static int previous_monitor_count = 0;
@@ -83,13 +173,678 @@ static int previous_total_height = 0;
 static int total_width = 0, total_height = 0;
 static int real_total_width = 0, real_total_height = 0;
 
-static xcb_window_t focus_stack[MAX_WINDOWS];
-static int focus_stack_top = -1;
 
 static int wallpaper_width = 0;
 static int wallpaper_height = 0;
 
-static xcb_pixmap_t load_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen, const char *path) {
+typedef void (*pixel_convert_fn)(const uint8_t *src, uint8_t *dst, int count);
+
+typedef struct {
+  int bits_per_pixel;
+  int scanline_pad;
+  int byte_order;
+  int visual_class;
+  uint32_t red_mask;
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  pixel_convert_fn convert;
+} pixel_format_t;
+
+static pixel_format_t wallpaper_format;
+static xcb_gcontext_t wallpaper_gc = XCB_NONE;
+static xcb_pixmap_t root_pixmap = XCB_PIXMAP_NONE;
+static int root_pixmap_mode = 0;
+static int wallpaper_pending = 0;
+static int wm_state_dirty = 0;
+static int profile_startup = 0;
+static uint64_t startup_us = 0;
+
+static xcb_rectangle_t damage[MAX_DAMAGE_RECTS];
+static int damage_count = 0;
+
+typedef struct {
+  char magic[8];
+  uint32_t key_length;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t depth;
+  uint32_t data_offset;
+} wallpaper_cache_header_t;
+
+typedef struct {
+  char name[64];
+  time_t mtime;
+  off_t size;
+} wallpaper_cache_entry_t;
+
+static unsigned long long stat_batches = 0;
+static unsigned long long stat_batch_events = 0;
+static unsigned long long stat_batch_flushes = 0;
+static unsigned int stat_max_batch_events = 0;
+static unsigned long long stat_batches_capped = 0;
+static unsigned long long stat_blits = 0;
+static unsigned long long stat_blit_bytes = 0;
+static unsigned long long stat_replies = 0;
+static unsigned long long stat_reply_us = 0;
+static unsigned long long stat_restacks = 0;
+static unsigned long long stat_continuations = 0;
+static unsigned long long stat_configures_merged = 0;
+static unsigned long long stat_configures_suppressed = 0;
+static unsigned long long stat_sync_requests = 0;
+static unsigned long long stat_sync_deferred = 0;
+static unsigned long long stat_sync_timeouts = 0;
+static unsigned long long stat_wallpaper_cached = 0;
+static unsigned long long stat_wallpaper_decoded = 0;
+static double stat_wallpaper_cached_ms = 0;
+static double stat_wallpaper_decoded_ms = 0;
+static int stat_max_in_flight = 0;
+
+enum {
+  METRIC_MAP_REQUEST,
+  METRIC_CONFIGURE_REQUEST,
+  METRIC_CLIENT_MESSAGE,
+  METRIC_DESTROY_NOTIFY,
+  METRIC_FOCUS_IN,
+  METRIC_FOCUS_OUT,
+  METRIC_PROPERTY_NOTIFY,
+  METRIC_EXPOSE,
+  METRIC_RANDR_NOTIFY,
+  METRIC_XI_HIERARCHY,
+  METRIC_SYNC_ALARM,
+  METRIC_OTHER,
+  METRIC_RANDR_APPLY,
+  METRIC_RANDR_PATCH,
+  METRIC_EXPOSE_REPAINT,
+  METRIC_RESTACK,
+  METRIC_CONTINUATION,
+  METRIC_MAP_TO_FOCUS,
+  METRIC_COUNT
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+  "MapRequest",
+  "ConfigureRequest",
+  "ClientMessage (other)",
+  "DestroyNotify",
+  "FocusIn",
+  "FocusOut",
+  "PropertyNotify",
+  "Expose",
+  "RandRNotify",
+  "XIHierarchy",
+  "SyncAlarm",
+  "Other",
+  "RandR apply",
+  "RandR patch",
+  "Expose repaint",
+  "Restack",
+  "Continuation",
+  "Map to focus"
+};
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long total_us;
+  unsigned long long max_us;
+  unsigned long long replies;
+  unsigned long long reply_us;
+  unsigned long long histogram[METRIC_BUCKETS];
+} metric_t;
+
+typedef struct {
+  xcb_atom_t atom;
+  metric_t metric;
+} client_message_metric_t;
+
+static metric_t metrics[METRIC_COUNT];
+static client_message_metric_t client_message_metrics[MAX_CLIENT_MESSAGE_METRICS];
+static int client_message_metric_count = 0;
+static metric_t *current_metric = NULL;
+static uint64_t metrics_start_us = 0;
+static char metrics_path[1024];
+
+typedef struct client_t {
+  xcb_window_t window;
+  uint32_t flags;
+  uint32_t stale;
+  uint64_t map_time_us;
+  int fullscreen_index;
+  xcb_atom_t *states;
+  uint32_t state_count;
+  uint32_t state_capacity;
+  uint32_t state_writes;
+  xcb_rectangle_t geometry;
+  int layer;
+  int applied_index;
+  int focus_monitor;
+  unsigned int configure_sequence;
+  uint64_t monitor_mask;
+  xcb_sync_counter_t sync_counter;
+  xcb_sync_alarm_t sync_alarm;
+  uint64_t sync_value;
+  uint64_t sync_sent_us;
+  xcb_rectangle_t pending_geometry;
+  struct client_t *focus_prev;
+  struct client_t *focus_next;
+  struct client_t *monitor_prev;
+  struct client_t *monitor_next;
+  struct client_t *next;
+} client_t;
+
+typedef struct {
+  uint32_t sources;
+  xcb_get_window_attributes_cookie_t attributes;
+  xcb_get_property_cookie_t type;
+  xcb_get_property_cookie_t protocols;
+  xcb_get_property_cookie_t sync_counter;
+  xcb_get_property_cookie_t state;
+} client_cookies_t;
+
+static client_t **clients = NULL;
+static uint32_t client_bucket_count = 0;
+static uint32_t client_count = 0;
+static client_t *focus_head = NULL;
+static client_t *monitor_focus_heads[MAX_MONITORS];
+static client_t **stack_clients = NULL;
+static int stack_count = 0;
+static int stack_capacity = 0;
+static client_t **applied_clients = NULL;
+static int applied_count = 0;
+static int applied_capacity = 0;
+static int stack_dirty = 0;
+
+typedef void (*continuation_fn_t)(xcb_connection_t *conn, void *reply, void *data);
+
+typedef struct {
+  unsigned int sequence;
+  int ordered;
+  int ready;
+  void *reply;
+  continuation_fn_t fn;
+  void *data;
+} continuation_t;
+
+static continuation_t *continuations = NULL;
+static int continuation_head = 0;
+static int continuation_count = 0;
+static int continuation_capacity = 0;
+
+static void convert_xrgb32_scalar(const uint8_t *src, uint8_t *dst, int count) {
+  uint32_t *out = (uint32_t *)dst;
+  for (int i = 0; i < count; i++) {
+    const uint8_t *px = &src[i * 4];
+    out[i] = 0xFF000000 | (px[0] << 16) | (px[1] << 8) | px[2];
+  }
+}
+
+static void convert_rgb30_scalar(const uint8_t *src, uint8_t *dst, int count) {
+  uint32_t *out = (uint32_t *)dst;
+  for (int i = 0; i < count; i++) {
+    const uint8_t *px = &src[i * 4];
+    uint32_t r = (px[0] << 2) | (px[0] >> 6);
+    uint32_t g = (px[1] << 2) | (px[1] >> 6);
+    uint32_t b = (px[2] << 2) | (px[2] >> 6);
+    out[i] = 0xC0000000 | (r << 20) | (g << 10) | b;
+  }
+}
+
+static void convert_rgb565_scalar(const uint8_t *src, uint8_t *dst, int count) {
+  uint16_t *out = (uint16_t *)dst;
+  for (int i = 0; i < count; i++) {
+    const uint8_t *px = &src[i * 4];
+    out[i] = ((px[0] >> 3) << 11) | ((px[1] >> 2) << 5) | (px[2] >> 3);
+  }
+}
+
+static int mask_shift(uint32_t mask) {
+  return mask ? __builtin_ctz(mask) : 0;
+}
+
+static int mask_bits(uint32_t mask) {
+  return __builtin_popcount(mask);
+}
+
+static uint32_t scale_channel(uint8_t value, int bits) {
+  if (bits <= 8)
+    return value >> (8 - bits);
+
+  uint32_t v = value << (bits - 8);
+  return v | (v >> 8);
+}
+
+static void convert_generic(const uint8_t *src, uint8_t *dst, int count) {
+  const pixel_format_t *f = &wallpaper_format;
+  int rs = mask_shift(f->red_mask), gs = mask_shift(f->green_mask), bs = mask_shift(f->blue_mask);
+  int rb = mask_bits(f->red_mask), gb = mask_bits(f->green_mask), bb = mask_bits(f->blue_mask);
+  int bytes = f->bits_per_pixel / 8;
+
+  for (int i = 0; i < count; i++) {
+    const uint8_t *px = &src[i * 4];
+    uint32_t v = (scale_channel(px[0], rb) << rs) | (scale_channel(px[1], gb) << gs) | (scale_channel(px[2], bb) << bs);
+    uint8_t *out = &dst[i * bytes];
+    for (int b = 0; b < bytes; b++) {
+      int shift = f->byte_order == XCB_IMAGE_ORDER_LSB_FIRST ? b * 8 : (bytes - 1 - b) * 8;
+      out[b] = (v >> shift) & 0xFF;
+    }
+  }
+}
+
+#ifdef SINWM_X86
+__attribute__((target("sse2")))
+static void convert_xrgb32_sse2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m128i low = _mm_set1_epi32(0xFF), mid = _mm_set1_epi32(0xFF00), alpha = _mm_set1_epi32(0xFF000000);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+    __m128i v = _mm_or_si128(_mm_or_si128(r, b), _mm_or_si128(_mm_and_si128(p, mid), alpha));
+    _mm_storeu_si128((__m128i *)&dst[i * 4], v);
+  }
+  convert_xrgb32_scalar(&src[i * 4], &dst[i * 4], count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_xrgb32_avx2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m256i low = _mm256_set1_epi32(0xFF), mid = _mm256_set1_epi32(0xFF00), alpha = _mm256_set1_epi32(0xFF000000);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, low), 16);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), low);
+    __m256i v = _mm256_or_si256(_mm256_or_si256(r, b), _mm256_or_si256(_mm256_and_si256(p, mid), alpha));
+    _mm256_storeu_si256((__m256i *)&dst[i * 4], v);
+  }
+  convert_xrgb32_scalar(&src[i * 4], &dst[i * 4], count - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_rgb30_sse2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m128i low = _mm_set1_epi32(0xFF), alpha = _mm_set1_epi32(0xC0000000);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+    __m128i r = _mm_and_si128(p, low);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), low);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+    r = _mm_or_si128(_mm_slli_epi32(r, 2), _mm_srli_epi32(r, 6));
+    g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 6));
+    b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 20), _mm_slli_epi32(g, 10)), _mm_or_si128(b, alpha));
+    _mm_storeu_si128((__m128i *)&dst[i * 4], v);
+  }
+  convert_rgb30_scalar(&src[i * 4], &dst[i * 4], count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb30_avx2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m256i low = _mm256_set1_epi32(0xFF), alpha = _mm256_set1_epi32(0xC0000000);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+    __m256i r = _mm256_and_si256(p, low);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), low);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), low);
+    r = _mm256_or_si256(_mm256_slli_epi32(r, 2), _mm256_srli_epi32(r, 6));
+    g = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 6));
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 2), _mm256_srli_epi32(b, 6));
+    __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 20), _mm256_slli_epi32(g, 10)), _mm256_or_si256(b, alpha));
+    _mm256_storeu_si256((__m256i *)&dst[i * 4], v);
+  }
+  convert_rgb30_scalar(&src[i * 4], &dst[i * 4], count - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_rgb565_sse2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m128i r_mask = _mm_set1_epi32(0xF8), g_mask = _mm_set1_epi32(0xFC00), b_mask = _mm_set1_epi32(0xF80000);
+  const __m128i bias32 = _mm_set1_epi32(0x8000), bias16 = _mm_set1_epi16((short)0x8000);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i p0 = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+    __m128i p1 = _mm_loadu_si128((const __m128i *)&src[i * 4 + 16]);
+    __m128i v0 = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(p0, r_mask), 8), _mm_srli_epi32(_mm_and_si128(p0, g_mask), 5)), _mm_srli_epi32(_mm_and_si128(p0, b_mask), 19));
+    __m128i v1 = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(p1, r_mask), 8), _mm_srli_epi32(_mm_and_si128(p1, g_mask), 5)), _mm_srli_epi32(_mm_and_si128(p1, b_mask), 19));
+    __m128i v = _mm_packs_epi32(_mm_sub_epi32(v0, bias32), _mm_sub_epi32(v1, bias32));
+    _mm_storeu_si128((__m128i *)&dst[i * 2], _mm_add_epi16(v, bias16));
+  }
+  convert_rgb565_scalar(&src[i * 4], &dst[i * 2], count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb565_avx2(const uint8_t *src, uint8_t *dst, int count) {
+  const __m256i r_mask = _mm256_set1_epi32(0xF8), g_mask = _mm256_set1_epi32(0xFC00), b_mask = _mm256_set1_epi32(0xF80000);
+  const __m256i bias32 = _mm256_set1_epi32(0x8000), bias16 = _mm256_set1_epi16((short)0x8000);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i p0 = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+    __m256i p1 = _mm256_loadu_si256((const __m256i *)&src[i * 4 + 32]);
+    __m256i v0 = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p0, r_mask), 8), _mm256_srli_epi32(_mm256_and_si256(p0, g_mask), 5)), _mm256_srli_epi32(_mm256_and_si256(p0, b_mask), 19));
+    __m256i v1 = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p1, r_mask), 8), _mm256_srli_epi32(_mm256_and_si256(p1, g_mask), 5)), _mm256_srli_epi32(_mm256_and_si256(p1, b_mask), 19));
+    __m256i v = _mm256_packs_epi32(_mm256_sub_epi32(v0, bias32), _mm256_sub_epi32(v1, bias32));
+    v = _mm256_permute4x64_epi64(_mm256_add_epi16(v, bias16), 0xD8);
+    _mm256_storeu_si256((__m256i *)&dst[i * 2], v);
+  }
+  convert_rgb565_sse2(&src[i * 4], &dst[i * 2], count - i);
+}
+#endif
+
+static int select_pixel_format(xcb_connection_t *conn, xcb_screen_t *screen) {
+  const xcb_setup_t *setup = xcb_get_setup(conn);
+  pixel_format_t *f = &wallpaper_format;
+  memset(f, 0, sizeof(*f));
+
+  xcb_format_t *formats = xcb_setup_pixmap_formats(setup);
+  int nformats = xcb_setup_pixmap_formats_length(setup);
+  for (int i = 0; i < nformats; i++) {
+    if (formats[i].depth == screen->root_depth) {
+      f->bits_per_pixel = formats[i].bits_per_pixel;
+      f->scanline_pad = formats[i].scanline_pad;
+      break;
+    }
+  }
+
+  for (xcb_depth_iterator_t di = xcb_screen_allowed_depths_iterator(screen); di.rem; xcb_depth_next(&di)) {
+    for (xcb_visualtype_iterator_t vi = xcb_depth_visuals_iterator(di.data); vi.rem; xcb_visualtype_next(&vi)) {
+      if (vi.data->visual_id == screen->root_visual) {
+        f->red_mask = vi.data->red_mask;
+        f->green_mask = vi.data->green_mask;
+        f->blue_mask = vi.data->blue_mask;
+        f->visual_class = vi.data->_class;
+      }
+    }
+  }
+
+  f->byte_order = setup->image_byte_order;
+
+  if (f->visual_class != XCB_VISUAL_CLASS_TRUE_COLOR && f->visual_class != XCB_VISUAL_CLASS_DIRECT_COLOR)
+    return -1;
+  if (f->bits_per_pixel != 8 && f->bits_per_pixel != 16 && f->bits_per_pixel != 24 && f->bits_per_pixel != 32)
+    return -1;
+  if (f->scanline_pad == 0)
+    f->scanline_pad = 32;
+
+  int lsb = f->byte_order == XCB_IMAGE_ORDER_LSB_FIRST;
+  pixel_convert_fn scalar = convert_generic;
+  pixel_convert_fn sse2 = NULL;
+  pixel_convert_fn avx2 = NULL;
+
+  if (lsb && f->bits_per_pixel == 32 && f->red_mask == 0xFF0000 && f->green_mask == 0xFF00 && f->blue_mask == 0xFF) {
+    scalar = convert_xrgb32_scalar;
+#ifdef SINWM_X86
+    sse2 = convert_xrgb32_sse2;
+    avx2 = convert_xrgb32_avx2;
+#endif
+  } else if (lsb && f->bits_per_pixel == 32 && f->red_mask == 0x3FF00000 && f->green_mask == 0xFFC00 && f->blue_mask == 0x3FF) {
+    scalar = convert_rgb30_scalar;
+#ifdef SINWM_X86
+    sse2 = convert_rgb30_sse2;
+    avx2 = convert_rgb30_avx2;
+#endif
+  } else if (lsb && f->bits_per_pixel == 16 && f->red_mask == 0xF800 && f->green_mask == 0x7E0 && f->blue_mask == 0x1F) {
+    scalar = convert_rgb565_scalar;
+#ifdef SINWM_X86
+    sse2 = convert_rgb565_sse2;
+    avx2 = convert_rgb565_avx2;
+#endif
+  }
+
+  f->convert = scalar;
+#ifdef SINWM_X86
+  __builtin_cpu_init();
+  if (avx2 && __builtin_cpu_supports("avx2"))
+    f->convert = avx2;
+  else if (sse2 && __builtin_cpu_supports("sse2"))
+    f->convert = sse2;
+#else
+  (void)sse2;
+  (void)avx2;
+#endif
+
+  return 0;
+}
+
+static int format_stride(const pixel_format_t *f, int width) {
+  int bits = width * f->bits_per_pixel;
+  return ((bits + f->scanline_pad - 1) / f->scanline_pad) * f->scanline_pad / 8;
+}
+
+static void convert_rows(const pixel_format_t *f, const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int count) {
+  for (int y = 0; y < count; y++)
+    f->convert(&src[(size_t)y * src_stride], &dst[(size_t)y * dst_stride], width);
+}
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void metrics_reply_wait(uint64_t start) {
+  uint64_t us = now_us() - start;
+  stat_replies++;
+  stat_reply_us += us;
+  if (current_metric) {
+    current_metric->replies++;
+    current_metric->reply_us += us;
+  }
+}
+
+static int write_all(int fd, const void *data, size_t length) {
+  const uint8_t *p = data;
+  while (length > 0) {
+    ssize_t n = write(fd, p, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static void cache_write(int *cache_fd, const void *data, size_t length) {
+  if (*cache_fd < 0)
+    return;
+
+  if (write_all(*cache_fd, data, length) != 0) {
+    close(*cache_fd);
+    *cache_fd = -1;
+  }
+}
+
+static void cache_write_header(int *cache_fd, const char *key, int width, int height, int stride, int depth) {
+  wallpaper_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WALLPAPER_CACHE_MAGIC, sizeof(header.magic));
+  header.key_length = strlen(key);
+  header.width = width;
+  header.height = height;
+  header.stride = stride;
+  header.depth = depth;
+  header.data_offset = (sizeof(header) + header.key_length + 63) & ~63u;
+
+  char pad[64] = { 0 };
+  cache_write(cache_fd, &header, sizeof(header));
+  cache_write(cache_fd, key, header.key_length);
+  cache_write(cache_fd, pad, header.data_offset - sizeof(header) - header.key_length);
+}
+
+static void put_image_strips(xcb_connection_t *conn, xcb_screen_t *screen, xcb_gcontext_t gc, const uint8_t *data, int stride, int width, int height) {
+  size_t max_request = (size_t)xcb_get_maximum_request_length(conn) * 4 - sizeof(xcb_put_image_request_t);
+  int strip_rows = max_request / stride;
+  if (strip_rows > WALLPAPER_STRIP_ROWS)
+    strip_rows = WALLPAPER_STRIP_ROWS;
+  if (strip_rows < 1) {
+    fprintf(stderr, "Wallpaper row of %d bytes exceeds the maximum request length, filling instead\n", stride);
+    fflush(stderr);
+    xcb_rectangle_t rect = { 0, 0, width, height };
+    xcb_poly_fill_rectangle(conn, pixmap, gc, 1, &rect);
+    return;
+  }
+
+  for (int y = 0; y < height; y += strip_rows) {
+    int n = height - y < strip_rows ? height - y : strip_rows;
+    xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc, width, n, 0, y, 0, screen->root_depth, n * stride, &data[(size_t)y * stride]);
+  }
+}
+
+static int wallpaper_cache_dir(char *out, size_t size) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char base[1024];
+
+  if (xdg && xdg[0])
+    snprintf(base, sizeof(base), "%s", xdg);
+  else if (home && home[0])
+    snprintf(base, sizeof(base), "%s/.cache", home);
+  else
+    return -1;
+
+  mkdir(base, 0700);
+  if (snprintf(out, size, "%s/sinwm", base) >= (int)size)
+    return -1;
+  if (mkdir(out, 0700) != 0 && errno != EEXIST)
+    return -1;
+
+  return 0;
+}
+
+static uint64_t fnv1a64(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s; s++) {
+    h ^= (uint8_t)*s;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int cmp_cache_entry_mtime(const void *a, const void *b) {
+  const wallpaper_cache_entry_t *ea = a;
+  const wallpaper_cache_entry_t *eb = b;
+  if (ea->mtime != eb->mtime)
+    return ea->mtime < eb->mtime ? -1 : 1;
+  return 0;
+}
+
+static void evict_wallpaper_cache(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  wallpaper_cache_entry_t *entries = NULL;
+  int count = 0, capacity = 0;
+  unsigned long long total = 0;
+
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    size_t len = strlen(de->d_name);
+    if (len < 4 || len >= sizeof(entries->name) || strcmp(de->d_name + len - 4, ".raw") != 0)
+      continue;
+
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (stat(path, &st) != 0)
+      continue;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      wallpaper_cache_entry_t *grown = realloc(entries, sizeof(*entries) * capacity);
+      if (!grown)
+        break;
+      entries = grown;
+    }
+
+    memcpy(entries[count].name, de->d_name, len + 1);
+    entries[count].mtime = st.st_mtime;
+    entries[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+  closedir(d);
+
+  qsort(entries, count, sizeof(*entries), cmp_cache_entry_mtime);
+
+  for (int i = 0; i < count - 1 && total > WALLPAPER_CACHE_MAX_BYTES; i++) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+    if (unlink(path) == 0)
+      total -= entries[i].size;
+  }
+
+  free(entries);
+}
+
+static xcb_pixmap_t load_cached_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen, const char *cache_path, const char *key) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0)
+    return XCB_PIXMAP_NONE;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(wallpaper_cache_header_t)) {
+    close(fd);
+    return XCB_PIXMAP_NONE;
+  }
+
+  uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return XCB_PIXMAP_NONE;
+  }
+
+  const wallpaper_cache_header_t *header = (const wallpaper_cache_header_t *)map;
+  size_t key_length = strlen(key);
+  size_t data_length = (size_t)header->stride * header->height;
+
+  int valid = memcmp(header->magic, WALLPAPER_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+              header->key_length == key_length &&
+              sizeof(*header) + key_length <= header->data_offset &&
+              header->depth == screen->root_depth &&
+              header->stride == (uint32_t)format_stride(&wallpaper_format, header->width) &&
+              header->data_offset + data_length <= (size_t)st.st_size &&
+              memcmp(map + sizeof(*header), key, key_length) == 0;
+
+  if (!valid) {
+    munmap(map, st.st_size);
+    close(fd);
+    unlink(cache_path);
+    return XCB_PIXMAP_NONE;
+  }
+
+  wallpaper_width = header->width;
+  wallpaper_height = header->height;
+
+  if (pixmap != XCB_PIXMAP_NONE)
+    xcb_free_pixmap(conn, pixmap);
+
+  pixmap = xcb_generate_id(conn);
+  xcb_create_pixmap(conn, screen->root_depth, pixmap, screen->root, wallpaper_width, wallpaper_height);
+
+  xcb_gcontext_t gc = xcb_generate_id(conn);
+  uint32_t mask_gc = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND;
+  uint32_t values_gc[] = { screen->black_pixel, screen->white_pixel };
+  xcb_create_gc(conn, gc, screen->root, mask_gc, values_gc);
+
+  put_image_strips(conn, screen, gc, map + header->data_offset, header->stride, wallpaper_width, wallpaper_height);
+
+  xcb_free_gc(conn, gc);
+  munmap(map, st.st_size);
+  futimens(fd, NULL);
+  close(fd);
+
+  return pixmap;
+}
+
+static xcb_pixmap_t decode_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen, const char *path, int *cache_fd, const char *key) {
   FILE *fp = fopen(path, "rb");
   if (!fp)
     return XCB_PIXMAP_NONE;
@@ -107,9 +862,21 @@ static xcb_pixmap_t load_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen,
     return XCB_PIXMAP_NONE;
   }
 
+  uint8_t *volatile buffer = NULL;
+  uint8_t *volatile converted = NULL;
+  volatile xcb_gcontext_t gc = XCB_NONE;
+
   if (setjmp(png_jmpbuf(png))) {
     png_destroy_read_struct(&png, &info, NULL);
     fclose(fp);
+    free(buffer);
+    free(converted);
+    if (gc != XCB_NONE)
+      xcb_free_gc(conn, gc);
+    if (pixmap != XCB_PIXMAP_NONE) {
+      xcb_free_pixmap(conn, pixmap);
+      pixmap = XCB_PIXMAP_NONE;
+    }
     return XCB_PIXMAP_NONE;
   }
 
@@ -127,16 +894,33 @@ static xcb_pixmap_t load_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen,
   if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
   if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE) png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
   if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png);
+  int passes = png_set_interlace_handling(png);
 
   png_read_update_info(png, info);
 
-  png_bytep *row_pointers = malloc(sizeof(png_bytep) * wallpaper_height);
-  for(int y = 0; y < wallpaper_height; y++)
-    row_pointers[y] = malloc(png_get_rowbytes(png, info));
+  const pixel_format_t *f = &wallpaper_format;
+  int src_stride = png_get_rowbytes(png, info);
+  int dst_stride = format_stride(f, wallpaper_width);
 
-  png_read_image(png, row_pointers);
-  fclose(fp);
-  png_destroy_read_struct(&png, &info, NULL);
+  size_t max_request = (size_t)xcb_get_maximum_request_length(conn) * 4 - sizeof(xcb_put_image_request_t);
+  int strip_rows = max_request / dst_stride;
+  if (strip_rows > WALLPAPER_STRIP_ROWS)
+    strip_rows = WALLPAPER_STRIP_ROWS;
+  if (strip_rows < 1)
+    png_error(png, "wallpaper row exceeds maximum request length");
+
+  cache_write_header(cache_fd, key, wallpaper_width, wallpaper_height, dst_stride, screen->root_depth);
+
+  int buffer_rows = passes > 1 ? wallpaper_height : strip_rows;
+  buffer = malloc((size_t)src_stride * buffer_rows);
+  if (!buffer)
+    png_error(png, "out of memory");
+
+  if (dst_stride > src_stride) {
+    converted = malloc((size_t)dst_stride * strip_rows);
+    if (!converted)
+      png_error(png, "out of memory");
+  }
 
   if (pixmap != XCB_PIXMAP_NONE)
     xcb_free_pixmap(conn, pixmap);
@@ -144,136 +928,544 @@ static xcb_pixmap_t load_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen,
   pixmap = xcb_generate_id(conn);
   xcb_create_pixmap(conn, screen->root_depth, pixmap, screen->root, wallpaper_width, wallpaper_height);
 
-  xcb_gcontext_t gc = xcb_generate_id(conn);
+  gc = xcb_generate_id(conn);
   uint32_t mask_gc = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND;
   uint32_t values_gc[] = { screen->black_pixel, screen->white_pixel };
   xcb_create_gc(conn, gc, screen->root, mask_gc, values_gc);
 
-  uint32_t *image_data = malloc(sizeof(uint32_t) * wallpaper_width * wallpaper_height);
-  for(int y = 0; y < wallpaper_height; y++) {
-    png_bytep row = row_pointers[y];
-    for(int x = 0; x < wallpaper_width; x++) {
-      png_bytep px = &(row[x * 4]);
+  if (passes > 1) {
+    png_bytep rows[WALLPAPER_STRIP_ROWS];
+    for (int pass = 0; pass < passes; pass++) {
+      for (int y = 0; y < wallpaper_height; y += WALLPAPER_STRIP_ROWS) {
+        int n = wallpaper_height - y < WALLPAPER_STRIP_ROWS ? wallpaper_height - y : WALLPAPER_STRIP_ROWS;
+        for (int i = 0; i < n; i++)
+          rows[i] = &buffer[(size_t)(y + i) * src_stride];
+        png_read_rows(png, rows, NULL, n);
+      }
+    }
+  }
+
+  png_bytep rows[WALLPAPER_STRIP_ROWS];
+  for (int y = 0; y < wallpaper_height; y += strip_rows) {
+    int n = wallpaper_height - y < strip_rows ? wallpaper_height - y : strip_rows;
+    uint8_t *strip = passes > 1 ? &buffer[(size_t)y * src_stride] : buffer;
 
-      uint32_t pixel = (0xFF << 24) | (px[0] << 16) | (px[1] << 8) | px[2];
-      image_data[y * wallpaper_width + x] = pixel;
+    if (passes == 1) {
+      for (int i = 0; i < n; i++)
+        rows[i] = &strip[(size_t)i * src_stride];
+      png_read_rows(png, rows, NULL, n);
     }
+
+    uint8_t *out = converted ? converted : strip;
+    convert_rows(f, strip, src_stride, out, dst_stride, wallpaper_width, n);
+    cache_write(cache_fd, out, (size_t)n * dst_stride);
+    xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc, wallpaper_width, n, 0, y, 0, screen->root_depth, n * dst_stride, out);
   }
 
-  int stride = wallpaper_width * 4;
-  xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc, wallpaper_width, wallpaper_height, 0, 0, 0, screen->root_depth, stride * wallpaper_height, (const uint8_t *)image_data);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(fp);
 
   xcb_free_gc(conn, gc);
-  xcb_flush(conn);
-  free(image_data);
-  for(int y = 0; y < wallpaper_height; y++)
-    free(row_pointers[y]);
-  free(row_pointers);
+  free(buffer);
+  free(converted);
 
   return pixmap;
 }
 
-static void set_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen) {
-  if (pixmap == XCB_PIXMAP_NONE)
-    return;
+static xcb_pixmap_t load_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen, const char *path) {
+  if (select_pixel_format(conn, screen) != 0) {
+    fprintf(stderr, "Unsupported root visual for wallpaper (depth %d)\n", screen->root_depth);
+    fflush(stderr);
+    return XCB_PIXMAP_NONE;
+  }
 
-  xcb_gcontext_t gc = xcb_generate_id(conn);
-  uint32_t mask_gc = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND;
-  uint32_t values_gc[] = { screen->black_pixel, screen->white_pixel };
-  xcb_create_gc(conn, gc, screen->root, mask_gc, values_gc);
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return XCB_PIXMAP_NONE;
 
-  for (int i = 0; i < monitor_count; i++) {
-    int x = monitors[i].x + (monitors[i].width - wallpaper_width) / 2;
-    int y = monitors[i].y + (monitors[i].height - wallpaper_height) / 2;
-    if (x < monitors[i].x)
-      x = monitors[i].x;
-    if (y < monitors[i].y)
-      y = monitors[i].y;
+  const pixel_format_t *f = &wallpaper_format;
+  char key[1280];
+  snprintf(key, sizeof(key), "%s\n%lld.%09ld\n%lld\n%d %d %d %d %08x %08x %08x",
+    path, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size,
+    screen->root_depth, f->bits_per_pixel, f->scanline_pad, f->byte_order,
+    f->red_mask, f->green_mask, f->blue_mask);
+
+  double start = now_ms();
+  char dir[1024], cache_path[1100], tmp_path[1150];
+  int have_cache = wallpaper_cache_dir(dir, sizeof(dir)) == 0;
+
+  if (have_cache) {
+    snprintf(cache_path, sizeof(cache_path), "%s/%016llx.raw", dir, (unsigned long long)fnv1a64(key));
+    if (load_cached_wallpaper(conn, screen, cache_path, key) != XCB_PIXMAP_NONE) {
+      stat_wallpaper_cached++;
+      stat_wallpaper_cached_ms = now_ms() - start;
+      return pixmap;
+    }
+  }
 
-    xcb_copy_area(conn, pixmap, screen->root, gc, 0, 0, x, y, wallpaper_width, wallpaper_height);
+  int cache_fd = -1;
+  if (have_cache) {
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid());
+    cache_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
   }
 
-  xcb_free_gc(conn, gc);
-}
+  xcb_pixmap_t decoded = decode_wallpaper(conn, screen, path, &cache_fd, key);
 
-static xcb_cursor_t create_blank_cursor(xcb_connection_t *conn, xcb_screen_t *screen) {
-  xcb_pixmap_t pixmap = xcb_generate_id(conn);
-  xcb_cursor_t cursor = xcb_generate_id(conn);
-  xcb_gcontext_t gc = xcb_generate_id(conn);
+  if (cache_fd >= 0) {
+    int ok = decoded != XCB_PIXMAP_NONE;
+    ok = close(cache_fd) == 0 && ok;
+    if (ok && rename(tmp_path, cache_path) == 0)
+      evict_wallpaper_cache(dir);
+    else
+      unlink(tmp_path);
+  } else if (have_cache) {
+    unlink(tmp_path);
+  }
 
-  xcb_create_pixmap(conn, 1, pixmap, screen->root, 1, 1);
+  if (decoded != XCB_PIXMAP_NONE) {
+    stat_wallpaper_decoded++;
+    stat_wallpaper_decoded_ms = now_ms() - start;
+  }
 
-  xcb_create_gc(conn, gc, pixmap, 0, NULL);
+  return decoded;
+}
 
-  uint32_t foreground = 0;
-  xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &foreground);
-  xcb_poly_fill_rectangle(conn, pixmap, gc, 1, &(xcb_rectangle_t){0, 0, 1, 1});
+static xcb_gcontext_t get_wallpaper_gc(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (wallpaper_gc == XCB_NONE) {
+    wallpaper_gc = xcb_generate_id(conn);
+    uint32_t mask_gc = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_GRAPHICS_EXPOSURES;
+    uint32_t values_gc[] = { screen->black_pixel, screen->white_pixel, 0 };
+    xcb_create_gc(conn, wallpaper_gc, screen->root, mask_gc, values_gc);
+  }
+  return wallpaper_gc;
+}
 
-  xcb_create_cursor(conn, cursor, pixmap, pixmap, 0, 0, 0, 0, 0, 0, 0, 0);
+static xcb_rectangle_t wallpaper_rect(monitor_t *m) {
+  int x = m->x + (m->width - wallpaper_width) / 2;
+  int y = m->y + (m->height - wallpaper_height) / 2;
+  if (x < m->x)
+    x = m->x;
+  if (y < m->y)
+    y = m->y;
 
-  xcb_free_gc(conn, gc);
-  xcb_free_pixmap(conn, pixmap);
+  return (xcb_rectangle_t){ x, y, wallpaper_width, wallpaper_height };
+}
 
-  return cursor;
+static void copy_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen, int src_x, int src_y, int dst_x, int dst_y, int width, int height) {
+  xcb_copy_area(conn, pixmap, screen->root, get_wallpaper_gc(conn, screen), src_x, src_y, dst_x, dst_y, width, height);
+  stat_blits++;
+  stat_blit_bytes += (unsigned long long)width * height * ((wallpaper_format.bits_per_pixel + 7) / 8);
 }
 
-static void push_focus(xcb_window_t window) {
-  for (int i = 0; i <= focus_stack_top; i++) {
-    if (focus_stack[i] == window) {
-      for (int j = i; j < focus_stack_top; j++) {
-        focus_stack[j] = focus_stack[j + 1];
-      }
-      focus_stack_top--;
-      break;
-    }
+static void set_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (pixmap == XCB_PIXMAP_NONE)
+    return;
+
+  for (int i = 0; i < monitor_count; i++) {
+    xcb_rectangle_t r = wallpaper_rect(&monitors[i]);
+    copy_wallpaper(conn, screen, 0, 0, r.x, r.y, r.width, r.height);
   }
 
-  if (focus_stack_top < MAX_WINDOWS - 1)
-    focus_stack[++focus_stack_top] = window;
+  damage_count = 0;
 }
 
-static void remove_focus(xcb_window_t window) {
-  for (int i = 0; i <= focus_stack_top; i++) {
-    if (focus_stack[i] == window) {
-      for (int j = i; j < focus_stack_top; j++) {
-        focus_stack[j] = focus_stack[j + 1];
-      }
-      focus_stack_top--;
-      break;
-    }
+static void compose_root_pixmap(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (pixmap == XCB_PIXMAP_NONE || total_width <= 0 || total_height <= 0)
+    return;
+
+  xcb_gcontext_t gc = get_wallpaper_gc(conn, screen);
+  xcb_pixmap_t composed = xcb_generate_id(conn);
+  xcb_create_pixmap(conn, screen->root_depth, composed, screen->root, total_width, total_height);
+  xcb_poly_fill_rectangle(conn, composed, gc, 1, &(xcb_rectangle_t){ 0, 0, total_width, total_height });
+
+  for (int i = 0; i < monitor_count; i++) {
+    xcb_rectangle_t r = wallpaper_rect(&monitors[i]);
+    xcb_copy_area(conn, pixmap, composed, gc, 0, 0, r.x, r.y, r.width, r.height);
+    stat_blits++;
+    stat_blit_bytes += (unsigned long long)r.width * r.height * ((wallpaper_format.bits_per_pixel + 7) / 8);
   }
+
+  xcb_change_window_attributes(conn, screen->root, XCB_CW_BACK_PIXMAP, &composed);
+  xcb_clear_area(conn, 0, screen->root, 0, 0, 0, 0);
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_xrootpmap_id, XCB_ATOM_PIXMAP, 32, 1, &composed);
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_esetroot_pmap_id, XCB_ATOM_PIXMAP, 32, 1, &composed);
+
+  if (root_pixmap != XCB_PIXMAP_NONE)
+    xcb_free_pixmap(conn, root_pixmap);
+  root_pixmap = composed;
 }
 
-static xcb_window_t get_top_focus() {
-  if (focus_stack_top >= 0)
-    return focus_stack[focus_stack_top];
-  return XCB_WINDOW_NONE;
+static void paint_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (root_pixmap_mode)
+    compose_root_pixmap(conn, screen);
+  else
+    set_wallpaper(conn, screen);
 }
 
-static void set_input_focus_ts(xcb_connection_t *conn, xcb_window_t window, xcb_timestamp_t ts) {
-  if (ts == 0)
-    ts = XCB_CURRENT_TIME;
+static int rect_contains(const xcb_rectangle_t *outer, const xcb_rectangle_t *inner) {
+  return inner->x >= outer->x && inner->y >= outer->y &&
+         inner->x + inner->width <= outer->x + outer->width &&
+         inner->y + inner->height <= outer->y + outer->height;
+}
 
-  xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, window, ts);
-  active_window = window;
-  push_focus(window);
+static void add_damage(int x, int y, int width, int height) {
+  xcb_rectangle_t r = { x, y, width, height };
 
-  xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
-  xcb_screen_t *screen = iter.data;
-  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_net_active_window, XCB_ATOM_WINDOW, 32, 1, &window);
+  for (int i = 0; i < damage_count; i++) {
+    if (rect_contains(&damage[i], &r))
+      return;
+    if (rect_contains(&r, &damage[i]))
+      damage[i--] = damage[--damage_count];
+  }
 
-  xcb_flush(conn);
+  if (damage_count == MAX_DAMAGE_RECTS) {
+    int x1 = r.x, y1 = r.y, x2 = r.x + r.width, y2 = r.y + r.height;
+    for (int i = 0; i < damage_count; i++) {
+      if (damage[i].x < x1)
+        x1 = damage[i].x;
+      if (damage[i].y < y1)
+        y1 = damage[i].y;
+      if (damage[i].x + damage[i].width > x2)
+        x2 = damage[i].x + damage[i].width;
+      if (damage[i].y + damage[i].height > y2)
+        y2 = damage[i].y + damage[i].height;
+    }
+    damage_count = 0;
+    r = (xcb_rectangle_t){ x1, y1, x2 - x1, y2 - y1 };
+  }
+
+  damage[damage_count++] = r;
 }
 
-static void set_input_focus(xcb_connection_t *conn, xcb_window_t window) {
-  set_input_focus_ts(conn, window, XCB_CURRENT_TIME);
+static void repaint_damage(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (pixmap == XCB_PIXMAP_NONE) {
+    damage_count = 0;
+    return;
+  }
+
+  for (int i = 0; i < monitor_count; i++) {
+    xcb_rectangle_t w = wallpaper_rect(&monitors[i]);
+
+    for (int j = 0; j < damage_count; j++) {
+      int x1 = damage[j].x > w.x ? damage[j].x : w.x;
+      int y1 = damage[j].y > w.y ? damage[j].y : w.y;
+      int x2 = damage[j].x + damage[j].width < w.x + w.width ? damage[j].x + damage[j].width : w.x + w.width;
+      int y2 = damage[j].y + damage[j].height < w.y + w.height ? damage[j].y + damage[j].height : w.y + w.height;
+
+      if (x2 > x1 && y2 > y1)
+        copy_wallpaper(conn, screen, x1 - w.x, y1 - w.y, x1, y1, x2 - x1, y2 - y1);
+    }
+  }
+
+  damage_count = 0;
 }
 
-static void remove_net_active_window(xcb_connection_t *conn) {
-  xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
-  xcb_screen_t *screen = iter.data;
-  xcb_delete_property(conn, screen->root, atom_net_active_window);
+static void handle_expose(xcb_expose_event_t *ev, xcb_screen_t *screen, int *repaint) {
+  if (ev->window != screen->root)
+    return;
+
+  add_damage(ev->x, ev->y, ev->width, ev->height);
+  if (ev->count == 0)
+    *repaint = 1;
+}
+
+static xcb_cursor_t create_blank_cursor(xcb_connection_t *conn, xcb_screen_t *screen) {
+  xcb_pixmap_t pixmap = xcb_generate_id(conn);
+  xcb_cursor_t cursor = xcb_generate_id(conn);
+  xcb_gcontext_t gc = xcb_generate_id(conn);
+
+  xcb_create_pixmap(conn, 1, pixmap, screen->root, 1, 1);
+
+  xcb_create_gc(conn, gc, pixmap, 0, NULL);
+
+  uint32_t foreground = 0;
+  xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &foreground);
+  xcb_poly_fill_rectangle(conn, pixmap, gc, 1, &(xcb_rectangle_t){0, 0, 1, 1});
+
+  xcb_create_cursor(conn, cursor, pixmap, pixmap, 0, 0, 0, 0, 0, 0, 0, 0);
+
+  xcb_free_gc(conn, gc);
+  xcb_free_pixmap(conn, pixmap);
+
+  return cursor;
+}
+
+static void flush_batch(xcb_connection_t *conn, unsigned int events) {
   xcb_flush(conn);
+  stat_batches++;
+  stat_batch_events += events;
+  stat_batch_flushes++;
+  if (events > stat_max_batch_events)
+    stat_max_batch_events = events;
+}
+
+static void metric_record(metric_t *m, uint64_t us) {
+  int bucket = 0;
+  while (bucket < METRIC_BUCKETS - 1 && (us >> bucket))
+    bucket++;
+
+  m->count++;
+  m->total_us += us;
+  if (us > m->max_us)
+    m->max_us = us;
+  m->histogram[bucket]++;
+}
+
+static metric_t *client_message_metric(xcb_atom_t atom) {
+  for (int i = 0; i < client_message_metric_count; i++) {
+    if (client_message_metrics[i].atom == atom)
+      return &client_message_metrics[i].metric;
+  }
+
+  if (client_message_metric_count == MAX_CLIENT_MESSAGE_METRICS)
+    return &metrics[METRIC_CLIENT_MESSAGE];
+
+  client_message_metric_t *cm = &client_message_metrics[client_message_metric_count++];
+  cm->atom = atom;
+  return &cm->metric;
+}
+
+static uint64_t metric_begin(metric_t *m) {
+  current_metric = m;
+  return now_us();
+}
+
+static void metric_end(uint64_t start) {
+  if (current_metric)
+    metric_record(current_metric, now_us() - start);
+  current_metric = NULL;
+}
+
+static unsigned long long metric_percentile(const metric_t *m, double p) {
+  unsigned long long rank = (unsigned long long)(m->count * p);
+  unsigned long long seen = 0;
+  for (int i = 0; i < METRIC_BUCKETS; i++) {
+    seen += m->histogram[i];
+    if (seen > rank)
+      return i == 0 ? 0 : 1ULL << i;
+  }
+  return m->max_us;
+}
+
+static const char *atom_label(xcb_atom_t atom) {
+  if (atom == atom_net_wm_state) return "_NET_WM_STATE";
+  if (atom == atom_net_active_window) return "_NET_ACTIVE_WINDOW";
+  if (atom == atom_net_close_window) return "_NET_CLOSE_WINDOW";
+  if (atom == atom_net_wm_fullscreen_monitors) return "_NET_WM_FULLSCREEN_MONITORS";
+  return NULL;
+}
+
+static void print_metric(FILE *out, const char *name, const metric_t *m) {
+  if (m->count == 0)
+    return;
+
+  fprintf(out, "%-40s %10llu %10.1f %10llu %10llu %10llu %8llu %10llu\n",
+    name,
+    m->count,
+    (double)m->total_us / m->count,
+    metric_percentile(m, 0.5),
+    metric_percentile(m, 0.99),
+    m->max_us,
+    m->replies,
+    m->reply_us);
+}
+
+static void print_metric_histogram(FILE *out, const char *name, const metric_t *m) {
+  if (m->count == 0)
+    return;
+
+  fprintf(out, "%s:", name);
+  for (int i = 0; i < METRIC_BUCKETS; i++) {
+    if (m->histogram[i])
+      fprintf(out, " <%llu:%llu", 1ULL << i, m->histogram[i]);
+  }
+  fprintf(out, "\n");
+}
+
+static void print_metrics(FILE *out) {
+  fprintf(out, "Uptime: %.1f s\n", (now_us() - metrics_start_us) / 1e6);
+
+  if (stat_batches > 0) {
+    fprintf(out, "Event batches: %llu, events/batch: %.2f (max %u), flushes/batch: %.2f, flushes/event: %.3f\n",
+      stat_batches,
+      (double)stat_batch_events / stat_batches,
+      stat_max_batch_events,
+      (double)stat_batch_flushes / stat_batches,
+      stat_batch_events ? (double)stat_batch_flushes / stat_batch_events : 0.0);
+    fprintf(out, "Batches capped at %d events or %d us: %llu\n", MAX_BATCH_EVENTS, MAX_BATCH_US, stat_batches_capped);
+  }
+  fprintf(out, "Reply waits: %llu, blocked: %llu us\n", stat_replies, stat_reply_us);
+  fprintf(out, "Wallpaper blits: %llu, bytes blitted: %llu\n", stat_blits, stat_blit_bytes);
+  fprintf(out, "Wallpaper loads from cache: %llu (last %.1f ms), decoded: %llu (last %.1f ms)\n",
+    stat_wallpaper_cached, stat_wallpaper_cached_ms, stat_wallpaper_decoded, stat_wallpaper_decoded_ms);
+  fprintf(out, "Restacks: %llu, restacks/event: %.3f\n", stat_restacks,
+    stat_batch_events ? (double)stat_restacks / stat_batch_events : 0.0);
+  fprintf(out, "Continuations: %llu, max in flight: %d\n", stat_continuations, stat_max_in_flight);
+  fprintf(out, "ConfigureRequests merged: %llu, suppressed: %llu\n", stat_configures_merged, stat_configures_suppressed);
+  fprintf(out, "Sync requests: %llu, resizes deferred: %llu, timeouts: %llu\n", stat_sync_requests, stat_sync_deferred, stat_sync_timeouts);
+
+  fprintf(out, "\n%-40s %10s %10s %10s %10s %10s %8s %10s\n", "event", "count", "mean_us", "p50_us", "p99_us", "max_us", "replies", "reply_us");
+  char name[128];
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (i == METRIC_CLIENT_MESSAGE) {
+      for (int j = 0; j < client_message_metric_count; j++) {
+        const char *label = atom_label(client_message_metrics[j].atom);
+        if (label)
+          snprintf(name, sizeof(name), "ClientMessage %s", label);
+        else
+          snprintf(name, sizeof(name), "ClientMessage atom %u", client_message_metrics[j].atom);
+        print_metric(out, name, &client_message_metrics[j].metric);
+      }
+    }
+    print_metric(out, metric_names[i], &metrics[i]);
+  }
+
+  fprintf(out, "\nLatency histograms (bucket upper bound in us:count)\n");
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (i == METRIC_CLIENT_MESSAGE) {
+      for (int j = 0; j < client_message_metric_count; j++) {
+        const char *label = atom_label(client_message_metrics[j].atom);
+        if (label)
+          snprintf(name, sizeof(name), "ClientMessage %s", label);
+        else
+          snprintf(name, sizeof(name), "ClientMessage atom %u", client_message_metrics[j].atom);
+        print_metric_histogram(out, name, &client_message_metrics[j].metric);
+      }
+    }
+    print_metric_histogram(out, metric_names[i], &metrics[i]);
+  }
+
+  fflush(out);
+}
+
+static void setup_metrics() {
+  metrics_start_us = now_us();
+
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime && runtime[0])
+    snprintf(metrics_path, sizeof(metrics_path), "%s/sinwm-metrics", runtime);
+  else
+    snprintf(metrics_path, sizeof(metrics_path), "/tmp/sinwm-metrics-%d", (int)getuid());
+}
+
+static void dump_metrics() {
+  char tmp_path[1100];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_path);
+
+  FILE *out = fopen(tmp_path, "w");
+  if (!out) {
+    fprintf(stderr, "Unable to write metrics to %s\n", tmp_path);
+    fflush(stderr);
+    return;
+  }
+
+  print_metrics(out);
+  if (fclose(out) != 0 || rename(tmp_path, metrics_path) != 0)
+    unlink(tmp_path);
+}
+
+static continuation_t *push_continuation(continuation_fn_t fn, void *data) {
+  if (continuation_count == continuation_capacity && continuation_head > 0) {
+    continuation_count -= continuation_head;
+    memmove(continuations, &continuations[continuation_head], sizeof(*continuations) * continuation_count);
+    continuation_head = 0;
+  }
+
+  if (continuation_count == continuation_capacity) {
+    int capacity = continuation_capacity ? continuation_capacity * 2 : 32;
+    continuation_t *grown = realloc(continuations, sizeof(*continuations) * capacity);
+    if (!grown)
+      return NULL;
+    continuations = grown;
+    continuation_capacity = capacity;
+  }
+
+  continuation_t *k = &continuations[continuation_count++];
+  memset(k, 0, sizeof(*k));
+  k->fn = fn;
+  k->data = data;
+
+  if (continuation_count - continuation_head > stat_max_in_flight)
+    stat_max_in_flight = continuation_count - continuation_head;
+  return k;
+}
+
+// Replies arrive in request order, so fn may also read the replies to any
+// earlier request without blocking. fn owns neither reply nor data.
+static void continue_after(xcb_connection_t *conn, unsigned int sequence, continuation_fn_t fn, void *data) {
+  continuation_t *k = push_continuation(fn, data);
+  if (k) {
+    k->sequence = sequence;
+    return;
+  }
+
+  xcb_generic_error_t *error = NULL;
+  void *reply = WAIT_REPLY(xcb_wait_for_reply(conn, sequence, &error));
+  fn(conn, reply, data);
+  free(error);
+  free(reply);
+  free(data);
+}
+
+static void continue_ordered(xcb_connection_t *conn, continuation_fn_t fn, void *data) {
+  continuation_t *k = continuation_head < continuation_count ? push_continuation(fn, data) : NULL;
+  if (k) {
+    k->ordered = 1;
+    return;
+  }
+
+  fn(conn, NULL, data);
+  free(data);
+}
+
+static void continue_after_barrier(xcb_connection_t *conn, continuation_fn_t fn, void *data) {
+  continue_after(conn, xcb_get_input_focus(conn).sequence, fn, data);
+}
+
+static int continuation_ready(xcb_connection_t *conn) {
+  if (continuation_head == continuation_count)
+    return 0;
+
+  continuation_t *k = &continuations[continuation_head];
+  if (k->ordered || k->ready)
+    return 1;
+
+  xcb_generic_error_t *error = NULL;
+  if (!xcb_poll_for_reply(conn, k->sequence, &k->reply, &error))
+    return 0;
+  free(error);
+  k->ready = 1;
+  return 1;
+}
+
+static void run_continuations(xcb_connection_t *conn) {
+  while (continuation_ready(conn)) {
+    continuation_t k = continuations[continuation_head++];
+    if (continuation_head == continuation_count)
+      continuation_head = continuation_count = 0;
+
+    uint64_t start = metric_begin(&metrics[METRIC_CONTINUATION]);
+    k.fn(conn, k.reply, k.data);
+    metric_end(start);
+    stat_continuations++;
+
+    free(k.reply);
+    free(k.data);
+  }
+}
+
+static void drain_continuations(xcb_connection_t *conn) {
+  while (continuation_head < continuation_count) {
+    continuation_t *k = &continuations[continuation_head];
+    if (!k->ordered && !k->ready) {
+      xcb_generic_error_t *error = NULL;
+      k->reply = WAIT_REPLY(xcb_wait_for_reply(conn, k->sequence, &error));
+      free(error);
+      k->ready = 1;
+    }
+    run_continuations(conn);
+  }
 }
 
 static void setup_atoms(xcb_connection_t *conn) {
@@ -295,27 +1487,39 @@ static void setup_atoms(xcb_connection_t *conn) {
                          , cookie_wm_protocols = xcb_intern_atom(conn, 0, strlen("WM_PROTOCOLS"), "WM_PROTOCOLS")
                          , cookie_wm_delete_window = xcb_intern_atom(conn, 0, strlen("WM_DELETE_WINDOW"), "WM_DELETE_WINDOW")
                          , cookie_ctm = xcb_intern_atom(conn, 0, strlen("Coordinate Transformation Matrix"), "Coordinate Transformation Matrix")
-                         , cookie_float = xcb_intern_atom(conn, 0, strlen("FLOAT"), "FLOAT");
-
-  xcb_intern_atom_reply_t *reply_wm_state = xcb_intern_atom_reply(conn, cookie_wm_state, NULL)
-                        , *reply_wm_state_above = xcb_intern_atom_reply(conn, cookie_wm_state_above, NULL)
-                        , *reply_wm_state_fullscreen = xcb_intern_atom_reply(conn, cookie_wm_state_fullscreen, NULL)
-                        , *reply_net_supported = xcb_intern_atom_reply(conn, cookie_net_supported, NULL)
-                        , *reply_net_supporting_wm_check = xcb_intern_atom_reply(conn, cookie_net_supporting_wm_check, NULL)
-                        , *reply_net_active_window = xcb_intern_atom_reply(conn, cookie_net_active_window, NULL)
-                        , *reply_net_wm_fullscreen_monitors = xcb_intern_atom_reply(conn, cookie_net_wm_fullscreen_monitors, NULL)
-                        , *reply_net_wm_name = xcb_intern_atom_reply(conn, cookie_net_wm_name, NULL)
-                        , *reply_net_wm_window_type = xcb_intern_atom_reply(conn, cookie_net_wm_window_type, NULL)
-                        , *reply_net_wm_window_type_dock = xcb_intern_atom_reply(conn, cookie_net_wm_window_type_dock, NULL)
-                        , *reply_net_close_window = xcb_intern_atom_reply(conn, cookie_net_close_window, NULL)
-                        , *reply_net_wm_window_type_splash = xcb_intern_atom_reply(conn, cookie_net_wm_window_type_splash, NULL)
-                        , *reply_utf8_string = xcb_intern_atom_reply(conn, cookie_utf8_string, NULL)
-                        , *reply_wm_name = xcb_intern_atom_reply(conn, cookie_wm_name, NULL)
-                        , *reply_wm_class = xcb_intern_atom_reply(conn, cookie_wm_class, NULL)
-                        , *reply_wm_protocols = xcb_intern_atom_reply(conn, cookie_wm_protocols, NULL)
-                        , *reply_wm_delete_window = xcb_intern_atom_reply(conn, cookie_wm_delete_window, NULL)
-                        , *reply_ctm = xcb_intern_atom_reply(conn, cookie_ctm, NULL)
-                        , *reply_float = xcb_intern_atom_reply(conn, cookie_float, NULL);
+                         , cookie_float = xcb_intern_atom(conn, 0, strlen("FLOAT"), "FLOAT")
+                         , cookie_xrootpmap_id = xcb_intern_atom(conn, 0, strlen("_XROOTPMAP_ID"), "_XROOTPMAP_ID")
+                         , cookie_esetroot_pmap_id = xcb_intern_atom(conn, 0, strlen("ESETROOT_PMAP_ID"), "ESETROOT_PMAP_ID")
+                         , cookie_net_client_list_stacking = xcb_intern_atom(conn, 0, strlen("_NET_CLIENT_LIST_STACKING"), "_NET_CLIENT_LIST_STACKING")
+                         , cookie_net_wm_sync_request = xcb_intern_atom(conn, 0, strlen("_NET_WM_SYNC_REQUEST"), "_NET_WM_SYNC_REQUEST")
+                         , cookie_net_wm_sync_request_counter = xcb_intern_atom(conn, 0, strlen("_NET_WM_SYNC_REQUEST_COUNTER"), "_NET_WM_SYNC_REQUEST_COUNTER")
+                         , cookie_sinwm_state = xcb_intern_atom(conn, 0, strlen("_SINWM_STATE"), "_SINWM_STATE");
+
+  xcb_intern_atom_reply_t *reply_wm_state = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_state, NULL))
+                        , *reply_wm_state_above = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_state_above, NULL))
+                        , *reply_wm_state_fullscreen = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_state_fullscreen, NULL))
+                        , *reply_net_supported = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_supported, NULL))
+                        , *reply_net_supporting_wm_check = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_supporting_wm_check, NULL))
+                        , *reply_net_active_window = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_active_window, NULL))
+                        , *reply_net_wm_fullscreen_monitors = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_fullscreen_monitors, NULL))
+                        , *reply_net_wm_name = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_name, NULL))
+                        , *reply_net_wm_window_type = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_window_type, NULL))
+                        , *reply_net_wm_window_type_dock = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_window_type_dock, NULL))
+                        , *reply_net_close_window = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_close_window, NULL))
+                        , *reply_net_wm_window_type_splash = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_window_type_splash, NULL))
+                        , *reply_utf8_string = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_utf8_string, NULL))
+                        , *reply_wm_name = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_name, NULL))
+                        , *reply_wm_class = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_class, NULL))
+                        , *reply_wm_protocols = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_protocols, NULL))
+                        , *reply_wm_delete_window = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_wm_delete_window, NULL))
+                        , *reply_ctm = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_ctm, NULL))
+                        , *reply_float = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_float, NULL))
+                        , *reply_xrootpmap_id = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_xrootpmap_id, NULL))
+                        , *reply_esetroot_pmap_id = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_esetroot_pmap_id, NULL))
+                        , *reply_net_client_list_stacking = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_client_list_stacking, NULL))
+                        , *reply_net_wm_sync_request = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_sync_request, NULL))
+                        , *reply_net_wm_sync_request_counter = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_net_wm_sync_request_counter, NULL))
+                        , *reply_sinwm_state = WAIT_REPLY(xcb_intern_atom_reply(conn, cookie_sinwm_state, NULL));
 
   if (reply_wm_state) { atom_net_wm_state = reply_wm_state->atom; free(reply_wm_state); }
   if (reply_wm_state_above) { atom_net_wm_state_above = reply_wm_state_above->atom; free(reply_wm_state_above); }
@@ -336,42 +1540,1053 @@ static void setup_atoms(xcb_connection_t *conn) {
   if (reply_wm_delete_window) { atom_wm_delete_window = reply_wm_delete_window->atom; free(reply_wm_delete_window); }
   if (reply_ctm) { atom_coordinate_transformation_matrix = reply_ctm->atom; free(reply_ctm); }
   if (reply_float) { atom_float = reply_float->atom; free(reply_float); }
+  if (reply_xrootpmap_id) { atom_xrootpmap_id = reply_xrootpmap_id->atom; free(reply_xrootpmap_id); }
+  if (reply_esetroot_pmap_id) { atom_esetroot_pmap_id = reply_esetroot_pmap_id->atom; free(reply_esetroot_pmap_id); }
+  if (reply_net_client_list_stacking) { atom_net_client_list_stacking = reply_net_client_list_stacking->atom; free(reply_net_client_list_stacking); }
+  if (reply_net_wm_sync_request) { atom_net_wm_sync_request = reply_net_wm_sync_request->atom; free(reply_net_wm_sync_request); }
+  if (reply_net_wm_sync_request_counter) { atom_net_wm_sync_request_counter = reply_net_wm_sync_request_counter->atom; free(reply_net_wm_sync_request_counter); }
+  if (reply_sinwm_state) { atom_sinwm_state = reply_sinwm_state->atom; free(reply_sinwm_state); }
+}
+
+static uint32_t client_bucket(xcb_window_t window) {
+  return (window ^ (window >> 8) ^ (window >> 16)) & (client_bucket_count - 1);
+}
+
+static void grow_clients() {
+  uint32_t old_count = client_bucket_count;
+  uint32_t new_count = old_count ? old_count * 2 : CLIENT_BUCKETS;
+  client_t **grown = calloc(new_count, sizeof(client_t *));
+  if (!grown)
+    return;
+
+  client_t **old = clients;
+  clients = grown;
+  client_bucket_count = new_count;
+
+  for (uint32_t i = 0; i < old_count; i++) {
+    client_t *c = old[i];
+    while (c) {
+      client_t *next = c->next;
+      uint32_t b = client_bucket(c->window);
+      c->next = clients[b];
+      clients[b] = c;
+      c = next;
+    }
+  }
+  free(old);
+}
+
+static client_t *find_client(xcb_window_t window) {
+  if (!clients)
+    return NULL;
+
+  for (client_t *c = clients[client_bucket(window)]; c; c = c->next) {
+    if (c->window == window)
+      return c;
+  }
+  return NULL;
+}
+
+static client_t *add_client(xcb_window_t window) {
+  client_t *c = find_client(window);
+  if (c)
+    return c;
+
+  if (client_count >= client_bucket_count)
+    grow_clients();
+  if (!clients)
+    return NULL;
+
+  c = calloc(1, sizeof(client_t));
+  if (!c)
+    return NULL;
+
+  uint32_t b = client_bucket(window);
+  c->window = window;
+  c->stale = SOURCE_ALL;
+  c->focus_monitor = -1;
+  c->next = clients[b];
+  clients[b] = c;
+  client_count++;
+  return c;
+}
+
+static int monitor_at(int x, int y) {
+  for (int i = 0; i < monitor_count; i++) {
+    if (x >= monitors[i].x && x < monitors[i].x + monitors[i].width &&
+        y >= monitors[i].y && y < monitors[i].y + monitors[i].height)
+      return i;
+  }
+  return -1;
+}
+
+static xcb_rectangle_t centered_geometry(const monitor_t *m) {
+  uint16_t width = m->width * 2 / 3;
+  uint16_t height = m->height * 2 / 3;
+  return (xcb_rectangle_t){ m->x + (m->width - width) / 2, m->y + (m->height - height) / 2, width, height };
+}
+
+static int client_monitor(const client_t *c) {
+  if (!(c->flags & CLIENT_HAS_GEOMETRY))
+    return -1;
+  return monitor_at(c->geometry.x + c->geometry.width / 2, c->geometry.y + c->geometry.height / 2);
+}
+
+// Indexed against previous_monitors, the last applied layout.
+#define OFFSCREEN_MONITOR MAX_MONITORS
+
+static client_t **monitor_clients[MAX_MONITORS + 1];
+static int monitor_client_count[MAX_MONITORS + 1];
+static int monitor_client_capacity[MAX_MONITORS + 1];
+
+static uint64_t client_monitor_mask(const client_t *c) {
+  if (!(c->flags & CLIENT_HAS_GEOMETRY))
+    return 0;
+
+  int x1 = c->geometry.x;
+  int y1 = c->geometry.y;
+  int x2 = x1 + c->geometry.width;
+  int y2 = y1 + c->geometry.height;
+
+  uint64_t mask = 0;
+  for (int i = 0; i < previous_monitor_count; i++) {
+    const monitor_t *m = &previous_monitors[i];
+    if (x2 > m->x && x1 < m->x + m->width && y2 > m->y && y1 < m->y + m->height)
+      mask |= 1ULL << i;
+  }
+  return mask ? mask : 1ULL << OFFSCREEN_MONITOR;
+}
+
+static void monitor_clients_add(int monitor, client_t *c) {
+  if (monitor_client_count[monitor] == monitor_client_capacity[monitor]) {
+    int capacity = monitor_client_capacity[monitor] ? monitor_client_capacity[monitor] * 2 : 16;
+    client_t **grown = realloc(monitor_clients[monitor], sizeof(client_t *) * capacity);
+    if (!grown)
+      return;
+    monitor_clients[monitor] = grown;
+    monitor_client_capacity[monitor] = capacity;
+  }
+  monitor_clients[monitor][monitor_client_count[monitor]++] = c;
+}
+
+static void monitor_clients_remove(int monitor, client_t *c) {
+  client_t **list = monitor_clients[monitor];
+  for (int i = 0; i < monitor_client_count[monitor]; i++) {
+    if (list[i] == c) {
+      list[i] = list[--monitor_client_count[monitor]];
+      return;
+    }
+  }
+}
+
+static void index_client(client_t *c) {
+  uint64_t mask = client_monitor_mask(c);
+  uint64_t changed = mask ^ c->monitor_mask;
+
+  for (int i = 0; changed; i++, changed >>= 1) {
+    if (!(changed & 1))
+      continue;
+    if (mask & (1ULL << i))
+      monitor_clients_add(i, c);
+    else
+      monitor_clients_remove(i, c);
+  }
+  c->monitor_mask = mask;
+}
+
+static void unindex_client(client_t *c) {
+  for (int i = 0; i <= OFFSCREEN_MONITOR; i++) {
+    if (c->monitor_mask & (1ULL << i))
+      monitor_clients_remove(i, c);
+  }
+  c->monitor_mask = 0;
+}
+
+static void rebuild_monitor_clients() {
+  for (int i = 0; i <= OFFSCREEN_MONITOR; i++)
+    monitor_client_count[i] = 0;
+
+  for (uint32_t b = 0; b < client_bucket_count; b++) {
+    for (client_t *c = clients[b]; c; c = c->next) {
+      c->monitor_mask = 0;
+      index_client(c);
+    }
+  }
+}
+
+static void monitor_focus_unlink(client_t *c) {
+  if (c->focus_monitor < 0)
+    return;
+
+  if (c->monitor_prev)
+    c->monitor_prev->monitor_next = c->monitor_next;
+  else
+    monitor_focus_heads[c->focus_monitor] = c->monitor_next;
+  if (c->monitor_next)
+    c->monitor_next->monitor_prev = c->monitor_prev;
+
+  c->monitor_prev = c->monitor_next = NULL;
+  c->focus_monitor = -1;
+}
+
+static void monitor_focus_link(client_t *c, int monitor) {
+  c->focus_monitor = monitor;
+  if (monitor < 0)
+    return;
+
+  client_t *before = c->focus_prev;
+  while (before && before->focus_monitor != monitor)
+    before = before->focus_prev;
+
+  c->monitor_prev = before;
+  c->monitor_next = before ? before->monitor_next : monitor_focus_heads[monitor];
+  if (c->monitor_next)
+    c->monitor_next->monitor_prev = c;
+  if (before)
+    before->monitor_next = c;
+  else
+    monitor_focus_heads[monitor] = c;
+}
+
+static void focus_unlink(client_t *c) {
+  if (!(c->flags & CLIENT_FOCUS_LIST))
+    return;
+
+  monitor_focus_unlink(c);
+  if (c->focus_prev)
+    c->focus_prev->focus_next = c->focus_next;
+  else
+    focus_head = c->focus_next;
+  if (c->focus_next)
+    c->focus_next->focus_prev = c->focus_prev;
+
+  c->focus_prev = c->focus_next = NULL;
+  c->flags &= ~CLIENT_FOCUS_LIST;
+}
+
+static void push_focus(xcb_window_t window) {
+  client_t *c = add_client(window);
+  if (!c)
+    return;
+
+  focus_unlink(c);
+  c->focus_next = focus_head;
+  if (focus_head)
+    focus_head->focus_prev = c;
+  focus_head = c;
+  c->flags |= CLIENT_FOCUS_LIST;
+  monitor_focus_link(c, client_monitor(c));
+}
+
+static void remove_focus(xcb_window_t window) {
+  client_t *c = find_client(window);
+  if (c)
+    focus_unlink(c);
+}
+
+static xcb_window_t get_top_focus() {
+  return focus_head ? focus_head->window : XCB_WINDOW_NONE;
+}
+
+static int focus_monitor_of(xcb_window_t window) {
+  client_t *c = find_client(window);
+  if (!c)
+    return -1;
+  return (c->flags & CLIENT_FOCUS_LIST) ? c->focus_monitor : client_monitor(c);
+}
+
+static xcb_window_t get_top_focus_on(int monitor) {
+  if (monitor >= 0 && monitor < monitor_count && monitor_focus_heads[monitor])
+    return monitor_focus_heads[monitor]->window;
+  return get_top_focus();
+}
+
+static void update_client_geometry(client_t *c, int x, int y, int width, int height) {
+  c->geometry = (xcb_rectangle_t){ x, y, width, height };
+  c->flags |= CLIENT_HAS_GEOMETRY;
+  index_client(c);
+
+  if (!(c->flags & CLIENT_FOCUS_LIST))
+    return;
+
+  int monitor = client_monitor(c);
+  if (monitor != c->focus_monitor) {
+    monitor_focus_unlink(c);
+    monitor_focus_link(c, monitor);
+  }
+}
+
+static void rebuild_monitor_focus() {
+  client_t *tails[MAX_MONITORS] = { 0 };
+  for (int i = 0; i < MAX_MONITORS; i++)
+    monitor_focus_heads[i] = NULL;
+
+  for (client_t *c = focus_head; c; c = c->focus_next) {
+    int monitor = client_monitor(c);
+    c->focus_monitor = monitor;
+    c->monitor_prev = c->monitor_next = NULL;
+    if (monitor < 0)
+      continue;
+
+    c->monitor_prev = tails[monitor];
+    if (tails[monitor])
+      tails[monitor]->monitor_next = c;
+    else
+      monitor_focus_heads[monitor] = c;
+    tails[monitor] = c;
+  }
+}
+
+static int client_layer(const client_t *c) {
+  if (c->flags & (CLIENT_DOCK | CLIENT_SPLASH))
+    return LAYER_DOCK;
+  if (c->flags & CLIENT_FULLSCREEN_LIST)
+    return LAYER_FULLSCREEN;
+  if (c->flags & CLIENT_ON_TOP_LIST)
+    return LAYER_ABOVE;
+  return LAYER_NORMAL;
+}
+
+static int reserve_stack(client_t ***array, int *capacity, int count) {
+  if (count <= *capacity)
+    return 0;
+
+  int grown_capacity = *capacity ? *capacity : 16;
+  while (grown_capacity < count)
+    grown_capacity *= 2;
+
+  client_t **grown = realloc(*array, sizeof(client_t *) * grown_capacity);
+  if (!grown)
+    return -1;
+  *array = grown;
+  *capacity = grown_capacity;
+  return 0;
+}
+
+static void stack_take(client_t *c) {
+  for (int i = 0; i < stack_count; i++) {
+    if (stack_clients[i] == c) {
+      memmove(&stack_clients[i], &stack_clients[i + 1], sizeof(client_t *) * (stack_count - i - 1));
+      stack_count--;
+      return;
+    }
+  }
+}
+
+static void stack_place(client_t *c, int top) {
+  int layer = c->layer = client_layer(c);
+  int pos;
+  if (top) {
+    pos = stack_count;
+    while (pos > 0 && stack_clients[pos - 1]->layer > layer)
+      pos--;
+  } else {
+    pos = 0;
+    while (pos < stack_count && stack_clients[pos]->layer < layer)
+      pos++;
+  }
+
+  memmove(&stack_clients[pos + 1], &stack_clients[pos], sizeof(client_t *) * (stack_count - pos));
+  stack_clients[pos] = c;
+  stack_count++;
+  stack_dirty = 1;
+}
+
+static void stack_insert(client_t *c) {
+  if (c->flags & CLIENT_STACKED) {
+    stack_take(c);
+  } else if (reserve_stack(&stack_clients, &stack_capacity, stack_count + 1) != 0) {
+    fprintf(stderr, "Out of memory stacking window 0x%08x.\n", c->window);
+    fflush(stderr);
+    return;
+  }
+
+  c->flags |= CLIENT_STACKED;
+  stack_place(c, 1);
+}
+
+static void stack_adopt(client_t *c) {
+  stack_insert(c);
+  if (!(c->flags & CLIENT_STACKED) || reserve_stack(&applied_clients, &applied_capacity, applied_count + 1) != 0)
+    return;
+  applied_clients[applied_count++] = c;
+}
+
+static void stack_raise(client_t *c) {
+  if (!(c->flags & CLIENT_STACKED))
+    return;
+  stack_take(c);
+  stack_place(c, 1);
+}
+
+static void stack_lower(client_t *c) {
+  if (!(c->flags & CLIENT_STACKED))
+    return;
+  stack_take(c);
+  stack_place(c, 0);
+}
+
+static int stack_index(client_t *c) {
+  for (int i = 0; i < stack_count; i++)
+    if (stack_clients[i] == c)
+      return i;
+  return -1;
+}
+
+static void stack_next_to(client_t *c, client_t *sibling, int above) {
+  stack_take(c);
+  int layer = c->layer = client_layer(c);
+  int lo = 0, hi = 0;
+  while (lo < stack_count && stack_clients[lo]->layer < layer)
+    lo++;
+  for (hi = lo; hi < stack_count && stack_clients[hi]->layer == layer; hi++);
+
+  int pos = stack_index(sibling) + (above ? 1 : 0);
+  pos = pos < lo ? lo : pos > hi ? hi : pos;
+  memmove(&stack_clients[pos + 1], &stack_clients[pos], sizeof(client_t *) * (stack_count - pos));
+  stack_clients[pos] = c;
+  stack_count++;
+  stack_dirty = 1;
+}
+
+// TopIf, BottomIf and Opposite are taken as a raise or lower, as ICCCM allows.
+static void stack_configure(client_t *c, client_t *sibling, uint8_t mode) {
+  if (!(c->flags & CLIENT_STACKED))
+    return;
+
+  if (mode == XCB_STACK_MODE_OPPOSITE) {
+    int i = stack_index(c);
+    mode = i + 1 < stack_count && stack_clients[i + 1]->layer == c->layer ? XCB_STACK_MODE_ABOVE : XCB_STACK_MODE_BELOW;
+    sibling = NULL;
+  }
+
+  int above = mode == XCB_STACK_MODE_ABOVE || mode == XCB_STACK_MODE_TOP_IF;
+  if (sibling && sibling != c && (sibling->flags & CLIENT_STACKED) && mode != XCB_STACK_MODE_TOP_IF &&
+      mode != XCB_STACK_MODE_BOTTOM_IF)
+    stack_next_to(c, sibling, above);
+  else if (above)
+    stack_raise(c);
+  else
+    stack_lower(c);
+}
+
+static void stack_relayer(client_t *c) {
+  if (!(c->flags & CLIENT_STACKED) || client_layer(c) == c->layer)
+    return;
+  stack_take(c);
+  stack_place(c, 1);
+}
+
+static void stack_remove(client_t *c) {
+  if (!(c->flags & CLIENT_STACKED))
+    return;
+
+  stack_take(c);
+  for (int i = 0; i < applied_count; i++) {
+    if (applied_clients[i] == c) {
+      memmove(&applied_clients[i], &applied_clients[i + 1], sizeof(client_t *) * (applied_count - i - 1));
+      applied_count--;
+      break;
+    }
+  }
+  c->flags &= ~CLIENT_STACKED;
+  stack_dirty = 1;
+}
+
+static unsigned int restack_window(xcb_connection_t *conn, xcb_window_t window, xcb_window_t sibling) {
+  xcb_void_cookie_t cookie;
+  if (sibling == XCB_WINDOW_NONE) {
+    uint32_t values[] = { XCB_STACK_MODE_BELOW };
+    cookie = xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_STACK_MODE, values);
+  } else {
+    uint32_t values[] = { sibling, XCB_STACK_MODE_ABOVE };
+    cookie = xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE, values);
+  }
+  stat_restacks++;
+  return cookie.sequence;
+}
+
+static void stack_sync(xcb_connection_t *conn, xcb_window_t root) {
+  if (!stack_dirty)
+    return;
+  stack_dirty = 0;
+
+  int n = stack_count;
+  for (int i = 0; i < n; i++)
+    stack_clients[i]->applied_index = -1;
+  for (int i = 0; i < applied_count; i++)
+    applied_clients[i]->applied_index = i;
+
+  int *tails = malloc(sizeof(int) * (n + 1));
+  int *prev = malloc(sizeof(int) * (n + 1));
+  uint8_t *keep = calloc(n + 1, 1);
+  if (tails && prev && keep) {
+    int length = 0;
+    for (int i = 0; i < n; i++) {
+      int index = stack_clients[i]->applied_index;
+      if (index < 0)
+        continue;
+
+      int lo = 0, hi = length;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (stack_clients[tails[mid]]->applied_index < index)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      prev[i] = lo > 0 ? tails[lo - 1] : -1;
+      tails[lo] = i;
+      if (lo == length)
+        length++;
+    }
+    for (int i = length ? tails[length - 1] : -1; i >= 0; i = prev[i])
+      keep[i] = 1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (keep && keep[i])
+      continue;
+    client_t *c = stack_clients[i];
+    c->configure_sequence = restack_window(conn, c->window, i > 0 ? stack_clients[i - 1]->window : XCB_WINDOW_NONE);
+  }
+  free(tails);
+  free(prev);
+  free(keep);
+
+  int changed = n != applied_count;
+  for (int i = 0; !changed && i < n; i++)
+    changed = applied_clients[i] != stack_clients[i];
+  if (!changed)
+    return;
+
+  if (reserve_stack(&applied_clients, &applied_capacity, n) != 0) {
+    applied_count = 0;
+    stack_dirty = 1;
+    return;
+  }
+  memcpy(applied_clients, stack_clients, sizeof(client_t *) * n);
+  applied_count = n;
+
+  xcb_window_t *windows = malloc(sizeof(xcb_window_t) * (n + 1));
+  if (!windows)
+    return;
+  for (int i = 0; i < n; i++)
+    windows[i] = stack_clients[i]->window;
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, root, atom_net_client_list_stacking, XCB_ATOM_WINDOW, 32, n, windows);
+  free(windows);
+}
+
+static void set_input_focus_ts(xcb_connection_t *conn, xcb_window_t window, xcb_timestamp_t ts) {
+  if (ts == 0)
+    ts = XCB_CURRENT_TIME;
+
+  xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, window, ts);
+  active_window = window;
+  push_focus(window);
+
+  xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+  xcb_screen_t *screen = iter.data;
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_net_active_window, XCB_ATOM_WINDOW, 32, 1, &window);
+}
+
+static void set_input_focus(xcb_connection_t *conn, xcb_window_t window) {
+  set_input_focus_ts(conn, window, XCB_CURRENT_TIME);
+}
+
+static void remove_net_active_window(xcb_connection_t *conn) {
+  xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+  xcb_screen_t *screen = iter.data;
+  xcb_delete_property(conn, screen->root, atom_net_active_window);
+}
+
+#define SYNC_TIMEOUT_US 200000
+
+static int have_sync = 0;
+static client_t **sync_waiting = NULL;
+static int sync_waiting_count = 0;
+static int sync_waiting_capacity = 0;
+
+static void sync_forget(client_t *c) {
+  for (int i = 0; i < sync_waiting_count; i++) {
+    if (sync_waiting[i] == c) {
+      sync_waiting[i] = sync_waiting[--sync_waiting_count];
+      break;
+    }
+  }
+  c->flags &= ~(CLIENT_SYNC_WAITING | CLIENT_SYNC_PENDING);
+}
+
+static int sync_expired(const client_t *c, uint64_t now) {
+  return now - c->sync_sent_us >= SYNC_TIMEOUT_US;
+}
+
+static void send_sync_request(xcb_connection_t *conn, client_t *c) {
+  if (sync_waiting_count == sync_waiting_capacity) {
+    int capacity = sync_waiting_capacity ? sync_waiting_capacity * 2 : 8;
+    client_t **grown = realloc(sync_waiting, sizeof(client_t *) * capacity);
+    if (!grown)
+      return;
+    sync_waiting = grown;
+    sync_waiting_capacity = capacity;
+  }
+
+  c->sync_value++;
+  xcb_client_message_event_t ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.response_type = XCB_CLIENT_MESSAGE;
+  ev.window = c->window;
+  ev.type = atom_wm_protocols;
+  ev.format = 32;
+  ev.data.data32[0] = atom_net_wm_sync_request;
+  ev.data.data32[1] = XCB_CURRENT_TIME;
+  ev.data.data32[2] = (uint32_t)c->sync_value;
+  ev.data.data32[3] = (uint32_t)(c->sync_value >> 32);
+  xcb_send_event(conn, 0, c->window, XCB_EVENT_MASK_NO_EVENT, (char *)&ev);
+
+  uint32_t mask = XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE |
+                  XCB_SYNC_CA_TEST_TYPE | XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS;
+  uint32_t values[] = {
+    c->sync_counter,
+    XCB_SYNC_VALUETYPE_ABSOLUTE,
+    (uint32_t)(c->sync_value >> 32), (uint32_t)c->sync_value,
+    XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON,
+    0, 0,
+    1
+  };
+  if (c->sync_alarm == XCB_NONE) {
+    c->sync_alarm = xcb_generate_id(conn);
+    xcb_sync_create_alarm(conn, c->sync_alarm, mask, values);
+  } else {
+    xcb_sync_change_alarm(conn, c->sync_alarm, mask, values);
+  }
+
+  c->sync_sent_us = now_us();
+  c->flags |= CLIENT_SYNC_WAITING;
+  sync_waiting[sync_waiting_count++] = c;
+  stat_sync_requests++;
+}
+
+static void remove_client(xcb_window_t window) {
+  if (!clients)
+    return;
+
+  client_t **link = &clients[client_bucket(window)];
+  while (*link) {
+    if ((*link)->window == window) {
+      client_t *c = *link;
+      *link = c->next;
+      focus_unlink(c);
+      stack_remove(c);
+      unindex_client(c);
+      sync_forget(c);
+      free(c->states);
+      free(c);
+      client_count--;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+static uint32_t flag_sources(uint32_t flags) {
+  uint32_t sources = 0;
+  if (flags & (CLIENT_DOCK | CLIENT_SPLASH))
+    sources |= SOURCE_TYPE;
+  if (flags & CLIENT_OVERRIDE_REDIRECT)
+    sources |= SOURCE_ATTRIBUTES;
+  if (flags & CLIENT_DELETE_WINDOW)
+    sources |= SOURCE_PROTOCOLS;
+  if (flags & (CLIENT_FULLSCREEN | CLIENT_ABOVE))
+    sources |= SOURCE_STATE;
+  return sources;
+}
+
+static int atom_list_contains(xcb_get_property_reply_t *r, xcb_atom_t atom) {
+  if (!r || r->type != XCB_ATOM_ATOM || r->format != 32)
+    return 0;
+
+  int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
+  xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
+  for (int i = 0; i < n; i++) {
+    if (atoms[i] == atom)
+      return 1;
+  }
+  return 0;
+}
+
+static void client_request(xcb_connection_t *conn, client_t *c, uint32_t sources, client_cookies_t *cookies) {
+  cookies->sources = sources;
+  if (sources & SOURCE_ATTRIBUTES)
+    cookies->attributes = xcb_get_window_attributes(conn, c->window);
+  if (sources & SOURCE_TYPE)
+    cookies->type = xcb_get_property(conn, 0, c->window, atom_net_wm_window_type, XCB_ATOM_ATOM, 0, 32);
+  if (sources & SOURCE_PROTOCOLS) {
+    cookies->protocols = xcb_get_property(conn, 0, c->window, atom_wm_protocols, XCB_ATOM_ATOM, 0, 32);
+    cookies->sync_counter = xcb_get_property(conn, 0, c->window, atom_net_wm_sync_request_counter, XCB_ATOM_CARDINAL, 0, 1);
+  }
+  if (sources & SOURCE_STATE)
+    cookies->state = xcb_get_property(conn, 0, c->window, atom_net_wm_state, XCB_ATOM_ATOM, 0, UINT32_MAX);
+}
+
+static int reserve_states(client_t *c, uint32_t count) {
+  if (count <= c->state_capacity)
+    return 0;
+
+  uint32_t capacity = c->state_capacity ? c->state_capacity : 8;
+  while (capacity < count)
+    capacity *= 2;
+
+  xcb_atom_t *grown = realloc(c->states, sizeof(xcb_atom_t) * capacity);
+  if (!grown)
+    return -1;
+  c->states = grown;
+  c->state_capacity = capacity;
+  return 0;
+}
+
+static void update_state_flags(client_t *c) {
+  c->flags &= ~(CLIENT_FULLSCREEN | CLIENT_ABOVE);
+  for (uint32_t i = 0; i < c->state_count; i++) {
+    if (c->states[i] == atom_net_wm_state_fullscreen)
+      c->flags |= CLIENT_FULLSCREEN;
+    else if (c->states[i] == atom_net_wm_state_above)
+      c->flags |= CLIENT_ABOVE;
+  }
+}
+
+static void collect_type(client_t *c, xcb_get_property_reply_t *r) {
+  c->flags &= ~(CLIENT_DOCK | CLIENT_SPLASH);
+  if (atom_list_contains(r, atom_net_wm_window_type_dock))
+    c->flags |= CLIENT_DOCK;
+  if (atom_list_contains(r, atom_net_wm_window_type_splash))
+    c->flags |= CLIENT_SPLASH;
+  c->stale &= ~SOURCE_TYPE;
+}
+
+typedef struct {
+  xcb_window_t window;
+  xcb_sync_counter_t counter;
+} sync_counter_context_t;
+
+static void finish_sync_counter(xcb_connection_t *conn, void *reply, void *data) {
+  sync_counter_context_t *ctx = data;
+  xcb_sync_query_counter_reply_t *r = reply;
+  client_t *c = find_client(ctx->window);
+  if (!r || !c || c->sync_counter != ctx->counter)
+    return;
+
+  c->sync_value = ((uint64_t)(uint32_t)r->counter_value.hi << 32) | r->counter_value.lo;
+  c->flags |= CLIENT_SYNC_SEEDED;
+}
+
+static void query_sync_counter(xcb_connection_t *conn, client_t *c) {
+  sync_counter_context_t *ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return;
+  ctx->window = c->window;
+  ctx->counter = c->sync_counter;
+  continue_after(conn, xcb_sync_query_counter(conn, c->sync_counter).sequence, finish_sync_counter, ctx);
+}
+
+static void client_collect(xcb_connection_t *conn, client_t *c, client_cookies_t *cookies) {
+  if (cookies->sources & SOURCE_ATTRIBUTES) {
+    xcb_get_window_attributes_reply_t *attr = WAIT_REPLY(xcb_get_window_attributes_reply(conn, cookies->attributes, NULL));
+    c->flags &= ~CLIENT_OVERRIDE_REDIRECT;
+    if (attr && attr->override_redirect)
+      c->flags |= CLIENT_OVERRIDE_REDIRECT;
+    free(attr);
+  }
+
+  if (cookies->sources & SOURCE_TYPE) {
+    xcb_get_property_reply_t *r = WAIT_REPLY(xcb_get_property_reply(conn, cookies->type, NULL));
+    collect_type(c, r);
+    free(r);
+  }
+
+  if (cookies->sources & SOURCE_PROTOCOLS) {
+    xcb_get_property_reply_t *r = WAIT_REPLY(xcb_get_property_reply(conn, cookies->protocols, NULL));
+    xcb_get_property_reply_t *counter = WAIT_REPLY(xcb_get_property_reply(conn, cookies->sync_counter, NULL));
+    c->flags &= ~(CLIENT_DELETE_WINDOW | CLIENT_SYNC_REQUEST);
+    if (atom_list_contains(r, atom_wm_delete_window))
+      c->flags |= CLIENT_DELETE_WINDOW;
+    if (atom_list_contains(r, atom_net_wm_sync_request) && counter && counter->type == XCB_ATOM_CARDINAL &&
+        counter->format == 32 && xcb_get_property_value_length(counter) >= 4) {
+      xcb_sync_counter_t id = *(uint32_t *)xcb_get_property_value(counter);
+      c->flags |= CLIENT_SYNC_REQUEST;
+      if (id != c->sync_counter) {
+        c->sync_counter = id;
+        c->flags &= ~CLIENT_SYNC_SEEDED;
+        if (have_sync)
+          query_sync_counter(conn, c);
+      }
+    }
+    free(counter);
+    free(r);
+  }
+
+  if (cookies->sources & SOURCE_STATE) {
+    xcb_get_property_reply_t *r = WAIT_REPLY(xcb_get_property_reply(conn, cookies->state, NULL));
+    c->state_count = 0;
+    if (r && r->type == XCB_ATOM_ATOM && r->format == 32) {
+      uint32_t n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
+      if (reserve_states(c, n) == 0) {
+        memcpy(c->states, xcb_get_property_value(r), sizeof(xcb_atom_t) * n);
+        c->state_count = n;
+      }
+    }
+    update_state_flags(c);
+    free(r);
+  }
+
+  c->stale &= ~cookies->sources;
+}
+
+static uint32_t client_query(xcb_connection_t *conn, xcb_window_t window, uint32_t want) {
+  client_t *c = add_client(window);
+  if (!c)
+    return 0;
+
+  uint32_t sources = c->stale & flag_sources(want);
+  if (sources) {
+    client_cookies_t cookies;
+    client_request(conn, c, sources, &cookies);
+    client_collect(conn, c, &cookies);
+  }
+
+  return c->flags & want;
+}
+
+static void handle_property_notify(xcb_property_notify_event_t *ev) {
+  client_t *c = find_client(ev->window);
+  if (!c)
+    return;
+
+  if (ev->atom == atom_net_wm_window_type)
+    c->stale |= SOURCE_TYPE;
+  else if (ev->atom == atom_wm_protocols || ev->atom == atom_net_wm_sync_request_counter)
+    c->stale |= SOURCE_PROTOCOLS;
+  else if (ev->atom == atom_net_wm_state && c->state_writes > 0)
+    c->state_writes--;
+  else if (ev->atom == atom_net_wm_state)
+    c->stale |= SOURCE_STATE;
+}
+
+static int is_always_on_top(xcb_window_t window) {
+  client_t *c = find_client(window);
+  return c && (c->flags & CLIENT_ON_TOP_LIST);
+}
+
+static void add_to_always_on_top(xcb_window_t window) {
+  client_t *c = add_client(window);
+  if (!c || (c->flags & CLIENT_ON_TOP_LIST))
+    return;
+
+  if (always_on_top_count == always_on_top_capacity) {
+    int capacity = always_on_top_capacity ? always_on_top_capacity * 2 : 16;
+    xcb_window_t *grown = realloc(always_on_top_windows, sizeof(*always_on_top_windows) * capacity);
+    if (!grown) {
+      fprintf(stderr, "Out of memory tracking always-on-top window 0x%08x.\n", window);
+      fflush(stderr);
+      return;
+    }
+    always_on_top_windows = grown;
+    always_on_top_capacity = capacity;
+  }
+
+  always_on_top_windows[always_on_top_count++] = window;
+  c->flags |= CLIENT_ON_TOP_LIST | CLIENT_ABOVE;
+  stack_relayer(c);
+}
+
+static void remove_from_always_on_top(xcb_window_t window) {
+  client_t *c = find_client(window);
+  if (!c)
+    return;
+
+  if (c->flags & CLIENT_ON_TOP_LIST) {
+    for (int i = 0; i < always_on_top_count; i++) {
+      if (always_on_top_windows[i] == window) {
+        memmove(&always_on_top_windows[i], &always_on_top_windows[i + 1], sizeof(*always_on_top_windows) * (always_on_top_count - i - 1));
+        always_on_top_count--;
+        break;
+      }
+    }
+  }
+  c->flags &= ~(CLIENT_ON_TOP_LIST | CLIENT_ABOVE);
+  stack_relayer(c);
+}
+
+static int find_fullscreen_window(xcb_window_t window) {
+  client_t *c = find_client(window);
+  return c && (c->flags & CLIENT_FULLSCREEN_LIST) ? c->fullscreen_index : -1;
 }
 
-static int is_always_on_top(xcb_window_t window) {
-  for (int i = 0; i < always_on_top_count; i++) {
-    if (always_on_top_windows[i] == window)
-      return 1;
+static int is_fullscreen_window(xcb_window_t window) {
+  return find_fullscreen_window(window) != -1;
+}
+
+static int track_fullscreen_window(xcb_window_t window, const xcb_rectangle_t *original_geometry) {
+  client_t *c = add_client(window);
+  if (!c)
+    return -1;
+
+  if (c->flags & CLIENT_FULLSCREEN_LIST)
+    return c->fullscreen_index;
+
+  if (fullscreen_count == fullscreen_capacity) {
+    int capacity = fullscreen_capacity ? fullscreen_capacity * 2 : 16;
+    fullscreen_window_t *grown_windows = realloc(fs_windows, sizeof(*fs_windows) * capacity);
+    if (!grown_windows)
+      return -1;
+    fs_windows = grown_windows;
+
+    fullscreen_geometry_t *grown_geometry = realloc(fs_geometry, sizeof(*fs_geometry) * capacity);
+    if (!grown_geometry)
+      return -1;
+    fs_geometry = grown_geometry;
+    fullscreen_capacity = capacity;
   }
-  return 0;
+
+  int index = fullscreen_count++;
+  fs_windows[index].window = window;
+  fs_windows[index].flags = 0;
+  fs_geometry[index].original_geometry = *original_geometry;
+  memset(fs_geometry[index].monitor_names, 0, sizeof(fs_geometry[index].monitor_names));
+
+  c->fullscreen_index = index;
+  c->flags |= CLIENT_FULLSCREEN_LIST | CLIENT_FULLSCREEN;
+  wm_state_dirty = 1;
+  stack_relayer(c);
+  return index;
 }
 
-static void add_to_always_on_top(xcb_window_t window) {
-  if (is_always_on_top(window))
-    return;
+static void untrack_fullscreen_window(int index) {
+  client_t *c = find_client(fs_windows[index].window);
+  if (c) {
+    c->flags &= ~(CLIENT_FULLSCREEN_LIST | CLIENT_FULLSCREEN);
+    stack_relayer(c);
+  }
 
-  if (always_on_top_count < MAX_WINDOWS)
-    always_on_top_windows[always_on_top_count++] = window;
+  int tail = fullscreen_count - index - 1;
+  memmove(&fs_windows[index], &fs_windows[index + 1], sizeof(*fs_windows) * tail);
+  memmove(&fs_geometry[index], &fs_geometry[index + 1], sizeof(*fs_geometry) * tail);
+  fullscreen_count--;
+  wm_state_dirty = 1;
+
+  for (int i = index; i < fullscreen_count; i++) {
+    client_t *moved = find_client(fs_windows[i].window);
+    if (moved)
+      moved->fullscreen_index = i;
+  }
 }
 
-static void remove_from_always_on_top(xcb_window_t window) {
-  for (int i = 0; i < always_on_top_count; i++) {
-    if (always_on_top_windows[i] == window) {
-      for (int j = i; j < always_on_top_count - 1; j++) {
-        always_on_top_windows[j] = always_on_top_windows[j + 1];
-      }
-      always_on_top_count--;
-      break;
-    }
+static uint16_t intern_output_name(const char *name) {
+  if (!name || !name[0])
+    return 0;
+
+  for (int i = 0; i < output_name_count; i++) {
+    if (strcmp(output_names[i], name) == 0)
+      return i + 1;
+  }
+
+  if (output_name_count == UINT16_MAX)
+    return 0;
+
+  if (output_name_count == output_name_capacity) {
+    int capacity = output_name_capacity ? output_name_capacity * 2 : 16;
+    char (*grown)[OUTPUT_NAME_MAX] = realloc(output_names, sizeof(*output_names) * capacity);
+    if (!grown)
+      return 0;
+    output_names = grown;
+    output_name_capacity = capacity;
   }
+
+  snprintf(output_names[output_name_count], OUTPUT_NAME_MAX, "%s", name);
+  return ++output_name_count;
 }
 
-static int is_fullscreen_window(xcb_window_t window) {
-  for (int i = 0; i < fullscreen_count; i++) {
-    if (fs_windows[i].window == window)
-      return 1;
+// Header: version, record count, name bytes. Records: window, flags, x|y,
+// width|height, names 0|1, names 2|3. Then the output names, NUL-separated.
+static void save_wm_state(xcb_connection_t *conn, xcb_window_t root) {
+  wm_state_dirty = 0;
+
+  uint32_t name_bytes = 0;
+  for (int i = 0; i < output_name_count; i++)
+    name_bytes += strlen(output_names[i]) + 1;
+
+  uint32_t words = WM_STATE_HEADER_WORDS + fullscreen_count * WM_STATE_RECORD_WORDS + (name_bytes + 3) / 4;
+  uint32_t *data = calloc(words, sizeof(uint32_t));
+  if (!data)
+    return;
+
+  data[0] = WM_STATE_VERSION;
+  data[1] = fullscreen_count;
+  data[2] = name_bytes;
+
+  uint32_t *record = &data[WM_STATE_HEADER_WORDS];
+  for (int i = 0; i < fullscreen_count; i++, record += WM_STATE_RECORD_WORDS) {
+    const xcb_rectangle_t *g = &fs_geometry[i].original_geometry;
+    const uint16_t *names = fs_geometry[i].monitor_names;
+    record[0] = fs_windows[i].window;
+    record[1] = fs_windows[i].flags;
+    record[2] = (uint32_t)(uint16_t)g->x << 16 | (uint16_t)g->y;
+    record[3] = (uint32_t)g->width << 16 | g->height;
+    record[4] = (uint32_t)names[0] << 16 | names[1];
+    record[5] = (uint32_t)names[2] << 16 | names[3];
   }
-  return 0;
+
+  char *name = (char *)record;
+  for (int i = 0; i < output_name_count; i++) {
+    size_t length = strlen(output_names[i]) + 1;
+    memcpy(name, output_names[i], length);
+    name += length;
+  }
+
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, root, atom_sinwm_state, XCB_ATOM_CARDINAL, 32, words, data);
+  free(data);
+}
+
+static const uint32_t *find_saved_fullscreen(xcb_get_property_reply_t *r, xcb_window_t window, uint16_t names[4]) {
+  if (!r || r->type != XCB_ATOM_CARDINAL || r->format != 32)
+    return NULL;
+
+  uint32_t words = xcb_get_property_value_length(r) / 4;
+  const uint32_t *data = xcb_get_property_value(r);
+  if (words < WM_STATE_HEADER_WORDS || data[0] != WM_STATE_VERSION)
+    return NULL;
+
+  uint32_t count = data[1];
+  uint32_t name_bytes = data[2];
+  if (count > (words - WM_STATE_HEADER_WORDS) / WM_STATE_RECORD_WORDS)
+    return NULL;
+
+  const uint32_t *records = &data[WM_STATE_HEADER_WORDS];
+  const char *table = (const char *)&records[count * WM_STATE_RECORD_WORDS];
+  if (name_bytes > (words - WM_STATE_HEADER_WORDS - count * WM_STATE_RECORD_WORDS) * 4)
+    return NULL;
+
+  for (uint32_t i = 0; i < count; i++) {
+    const uint32_t *record = &records[i * WM_STATE_RECORD_WORDS];
+    if (record[0] != window)
+      continue;
+
+    uint16_t saved[4] = { record[4] >> 16, record[4] & 0xFFFF, record[5] >> 16, record[5] & 0xFFFF };
+    for (int j = 0; j < 4; j++) {
+      const char *entry = table;
+      for (uint16_t id = 1; id < saved[j] && entry < table + name_bytes; id++)
+        entry += strnlen(entry, table + name_bytes - entry) + 1;
+
+      char output_name[OUTPUT_NAME_MAX];
+      names[j] = 0;
+      if (saved[j] && entry < table + name_bytes) {
+        snprintf(output_name, sizeof(output_name), "%.*s", (int)strnlen(entry, table + name_bytes - entry), entry);
+        names[j] = intern_output_name(output_name);
+      }
+    }
+    return record;
+  }
+  return NULL;
 }
 
 static void setup_ewmh(xcb_connection_t *conn, xcb_screen_t *screen) {
@@ -390,9 +2605,12 @@ static void setup_ewmh(xcb_connection_t *conn, xcb_screen_t *screen) {
     atom_net_wm_name,
     atom_net_wm_window_type,
     atom_net_close_window,
-    atom_net_wm_window_type_splash
+    atom_net_wm_window_type_splash,
+    atom_net_client_list_stacking,
+    atom_net_wm_sync_request
   };
-  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_net_supported, XCB_ATOM_ATOM, 32, sizeof(supported_atoms) / sizeof(xcb_atom_t), supported_atoms);
+  int supported_count = sizeof(supported_atoms) / sizeof(xcb_atom_t) - (have_sync ? 0 : 1);
+  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, atom_net_supported, XCB_ATOM_ATOM, 32, supported_count, supported_atoms);
   const char *wm_name = "SinWM";
   xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wm_support_window, atom_wm_name, XCB_ATOM_STRING, 8, strlen(wm_name), wm_name);
   const char *net_wm_name = "SinWM";
@@ -403,7 +2621,6 @@ static void setup_ewmh(xcb_connection_t *conn, xcb_screen_t *screen) {
   xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wm_support_window, atom_wm_protocols, XCB_ATOM_ATOM, 32, sizeof(protocols)/sizeof(xcb_atom_t), protocols);
 
   xcb_map_window(conn, wm_support_window);
-  xcb_flush(conn);
 }
 
 static void send_configure_notify(xcb_connection_t *conn, xcb_window_t window, int x, int y, int width, int height) {
@@ -422,44 +2639,179 @@ static void send_configure_notify(xcb_connection_t *conn, xcb_window_t window, i
   ev.override_redirect = 0;
 
   xcb_send_event(conn, 0, window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char *)&ev);
-  xcb_flush(conn);
 }
 
-static xcb_randr_output_t get_primary_output(xcb_connection_t *conn, xcb_window_t root) {
-  xcb_randr_get_output_primary_cookie_t c = xcb_randr_get_output_primary(conn, root);
-  xcb_randr_get_output_primary_reply_t *r = xcb_randr_get_output_primary_reply(conn, c, NULL);
+typedef struct {
+  xcb_window_t window;
+  uint16_t value_mask;
+  int16_t x, y;
+  uint16_t width, height, border_width;
+  xcb_window_t sibling;
+  uint8_t stack_mode;
+} configure_request_t;
+
+static configure_request_t *pending_configures = NULL;
+static unsigned int last_event_sequence = 0;
+static int pending_configure_count = 0;
+static int pending_configure_capacity = 0;
+
+static configure_request_t *find_configure_request(xcb_window_t window) {
+  for (int i = pending_configure_count - 1; i >= 0; i--) {
+    if (pending_configures[i].window == window)
+      return &pending_configures[i];
+  }
+  return NULL;
+}
+
+static void drop_configure_request(xcb_window_t window) {
+  configure_request_t *r = find_configure_request(window);
+  if (r)
+    *r = pending_configures[--pending_configure_count];
+}
 
-  if (!r)
-    return XCB_NONE;
+// The shadow is only trusted once no configure of ours is still in flight.
+// Events and errors arrive in request order, so once one at or past the
+// configure's sequence has been seen its ConfigureNotify, if any, has too.
+static int configure_in_flight(const client_t *c) {
+  return c->configure_sequence && (int)(last_event_sequence - c->configure_sequence) < 0;
+}
 
-  xcb_randr_output_t primary = r->output;
-  free(r);
-  return primary;
+static void apply_configure_request(xcb_connection_t *conn, const configure_request_t *r) {
+  uint32_t values[7];
+  uint16_t mask = 0;
+  int i = 0;
+  int notified = 0;
+
+  if (r->value_mask & XCB_CONFIG_WINDOW_X) values[i++] = r->x, mask |= XCB_CONFIG_WINDOW_X;
+  if (r->value_mask & XCB_CONFIG_WINDOW_Y) values[i++] = r->y, mask |= XCB_CONFIG_WINDOW_Y;
+  if (r->value_mask & XCB_CONFIG_WINDOW_WIDTH) values[i++] = r->width, mask |= XCB_CONFIG_WINDOW_WIDTH;
+  if (r->value_mask & XCB_CONFIG_WINDOW_HEIGHT) values[i++] = r->height, mask |= XCB_CONFIG_WINDOW_HEIGHT;
+  if (r->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) values[i++] = r->border_width, mask |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
+
+  client_t *c = find_client(r->window);
+  if (c && (c->flags & CLIENT_HAS_GEOMETRY) && !configure_in_flight(c) && !(mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)) {
+    xcb_rectangle_t g = c->geometry;
+    if ((!(mask & XCB_CONFIG_WINDOW_X) || r->x == g.x) &&
+        (!(mask & XCB_CONFIG_WINDOW_Y) || r->y == g.y) &&
+        (!(mask & XCB_CONFIG_WINDOW_WIDTH) || r->width == g.width) &&
+        (!(mask & XCB_CONFIG_WINDOW_HEIGHT) || r->height == g.height)) {
+      if (mask) {
+        stat_configures_suppressed++;
+        send_configure_notify(conn, r->window, g.x, g.y, g.width, g.height);
+        notified = 1;
+      }
+      mask = 0;
+      i = 0;
+    }
+  }
+
+  if (c && (c->flags & CLIENT_STACKED)) {
+    if (r->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+      client_t *sibling = (r->value_mask & XCB_CONFIG_WINDOW_SIBLING) ? find_client(r->sibling) : NULL;
+      stack_configure(c, sibling, r->stack_mode);
+      if (i == 0 && !notified && (c->flags & CLIENT_HAS_GEOMETRY)) {
+        xcb_rectangle_t g = c->geometry;
+        send_configure_notify(conn, r->window, g.x, g.y, g.width, g.height);
+      }
+    }
+  } else {
+    if (r->value_mask & XCB_CONFIG_WINDOW_SIBLING) values[i++] = r->sibling, mask |= XCB_CONFIG_WINDOW_SIBLING;
+    if (r->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) values[i++] = r->stack_mode, mask |= XCB_CONFIG_WINDOW_STACK_MODE;
+  }
+
+  if (i > 0) {
+    xcb_void_cookie_t cookie = xcb_configure_window(conn, r->window, mask, values);
+    if (c)
+      c->configure_sequence = cookie.sequence;
+  }
+}
+
+static void flush_configure_request(xcb_connection_t *conn, xcb_window_t window) {
+  configure_request_t *r = find_configure_request(window);
+  if (r) {
+    apply_configure_request(conn, r);
+    *r = pending_configures[--pending_configure_count];
+  }
 }
 
-static monitor_t *get_primary_monitor(xcb_connection_t *conn, xcb_screen_t *screen) {
-  xcb_randr_output_t primary_output = get_primary_output(conn, screen->root);
+// The ConfigureNotify this causes is awaited through configure_sequence.
+static void configure_window_geometry(xcb_connection_t *conn, xcb_window_t window, int x, int y, int width, int height) {
+  flush_configure_request(conn, window);
 
-  if (primary_output == XCB_NONE)
-    return NULL;
+  client_t *c = find_client(window);
+  if (c && (c->flags & CLIENT_SYNC_WAITING)) {
+    if (!sync_expired(c, now_us())) {
+      c->pending_geometry = (xcb_rectangle_t){ x, y, width, height };
+      c->flags |= CLIENT_SYNC_PENDING;
+      stat_sync_deferred++;
+      return;
+    }
+    sync_forget(c);
+  }
 
-  xcb_randr_get_output_info_reply_t *info = xcb_randr_get_output_info_reply(conn, xcb_randr_get_output_info(conn, primary_output, XCB_CURRENT_TIME), NULL);
+  if (c && have_sync && (c->flags & (CLIENT_SYNC_REQUEST | CLIENT_SYNC_SEEDED | CLIENT_MAPPED)) == (CLIENT_SYNC_REQUEST | CLIENT_SYNC_SEEDED | CLIENT_MAPPED) &&
+      !(c->stale & SOURCE_PROTOCOLS) && (width != c->geometry.width || height != c->geometry.height))
+    send_sync_request(conn, c);
 
-  if (!info)
-    return NULL;
+  uint32_t values[] = { x, y, width, height };
+  uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+  xcb_void_cookie_t cookie = xcb_configure_window(conn, window, mask, values);
+  send_configure_notify(conn, window, x, y, width, height);
 
-  xcb_randr_crtc_t crtc = info->crtc;
-  free(info);
+  if (c) {
+    c->configure_sequence = cookie.sequence;
+    update_client_geometry(c, x, y, width, height);
+  }
+}
 
-  if (crtc == XCB_NONE)
-    return NULL;
+static void finish_sync(xcb_connection_t *conn, client_t *c) {
+  int pending = (c->flags & CLIENT_SYNC_PENDING) != 0;
+  xcb_rectangle_t g = c->pending_geometry;
+  sync_forget(c);
+  if (pending)
+    configure_window_geometry(conn, c->window, g.x, g.y, g.width, g.height);
+}
 
-  for (int i = 0; i < monitor_count; i++) {
-    if (monitors[i].crtc == crtc)
-      return &monitors[i];
+static void handle_sync_alarm(xcb_connection_t *conn, xcb_sync_alarm_notify_event_t *ev) {
+  uint64_t value = ((uint64_t)(uint32_t)ev->counter_value.hi << 32) | ev->counter_value.lo;
+  for (int i = 0; i < sync_waiting_count; i++) {
+    client_t *c = sync_waiting[i];
+    if (c->sync_alarm != ev->alarm)
+      continue;
+    if (value >= c->sync_value || ev->state == XCB_SYNC_ALARMSTATE_DESTROYED)
+      finish_sync(conn, c);
+    return;
   }
+}
 
-  return NULL;
+static void expire_sync_requests(xcb_connection_t *conn) {
+  uint64_t now = now_us();
+  for (int i = sync_waiting_count - 1; i >= 0; i--) {
+    client_t *c = sync_waiting[i];
+    if (!sync_expired(c, now))
+      continue;
+    if (c->flags & CLIENT_SYNC_PENDING)
+      stat_sync_timeouts++;
+    finish_sync(conn, c);
+  }
+}
+
+static int sync_timeout_ms(void) {
+  uint64_t now = now_us();
+  int timeout = -1;
+  for (int i = 0; i < sync_waiting_count; i++) {
+    const client_t *c = sync_waiting[i];
+    if (!(c->flags & CLIENT_SYNC_PENDING))
+      continue;
+    int ms = sync_expired(c, now) ? 0 : (int)((c->sync_sent_us + SYNC_TIMEOUT_US - now + 999) / 1000);
+    if (timeout < 0 || ms < timeout)
+      timeout = ms;
+  }
+  return timeout;
+}
+
+static monitor_t *get_primary_monitor(void) {
+  return primary_monitor >= 0 ? &monitors[primary_monitor] : NULL;
 }
 
 static int cmp_monitor_xy(const void *a, const void *b) {
@@ -472,48 +2824,34 @@ static int cmp_monitor_xy(const void *a, const void *b) {
   return 0;
 }
 
-static int get_output_name(xcb_connection_t *conn, xcb_randr_output_t output, char out_name[OUTPUT_NAME_MAX]) {
+static void copy_output_name(char out_name[OUTPUT_NAME_MAX], const char *name, int len) {
   out_name[0] = '\0';
-
-  xcb_randr_get_output_info_reply_t *info = xcb_randr_get_output_info_reply(conn, xcb_randr_get_output_info(conn, output, XCB_CURRENT_TIME), NULL);
-
-  if (!info)
-    return -1;
-
-  int len = xcb_randr_get_output_info_name_length(info);
-  const char *name = (const char *)xcb_randr_get_output_info_name(info);
-
-  if (len <= 0 || !name) {
-    free(info);
-    return -1;
-  }
+  if (len <= 0 || !name)
+    return;
 
   if (len >= OUTPUT_NAME_MAX)
     len = OUTPUT_NAME_MAX - 1;
 
   memcpy(out_name, name, len);
   out_name[len] = '\0';
-
-  free(info);
-  return 0;
 }
 
 static void build_xinerama_map(xcb_connection_t *conn) {
   ewmh_index_count = 0;
 
-  xcb_xinerama_is_active_reply_t *active_reply = xcb_xinerama_is_active_reply(conn, xcb_xinerama_is_active(conn), NULL);
-  if (!active_reply)
-    return;
+  xcb_xinerama_is_active_cookie_t active_cookie = xcb_xinerama_is_active(conn);
+  xcb_xinerama_query_screens_cookie_t screens_cookie = xcb_xinerama_query_screens(conn);
 
-  int active = active_reply->state;
-  free(active_reply);
+  xcb_xinerama_is_active_reply_t *active_reply = WAIT_REPLY(xcb_xinerama_is_active_reply(conn, active_cookie, NULL));
+  xcb_xinerama_query_screens_reply_t *screens_reply = WAIT_REPLY(xcb_xinerama_query_screens_reply(conn, screens_cookie, NULL));
 
-  if (!active)
-    return;
+  int active = active_reply && active_reply->state;
+  free(active_reply);
 
-  xcb_xinerama_query_screens_reply_t *screens_reply = xcb_xinerama_query_screens_reply(conn, xcb_xinerama_query_screens(conn), NULL);
-  if (!screens_reply)
+  if (!active || !screens_reply) {
+    free(screens_reply);
     return;
+  }
 
   int n = xcb_xinerama_query_screens_screen_info_length(screens_reply);
   xcb_xinerama_screen_info_t *info = xcb_xinerama_query_screens_screen_info(screens_reply);
@@ -539,144 +2877,502 @@ static void build_xinerama_map(xcb_connection_t *conn) {
   free(screens_reply);
 }
 
-static void query_xrandr(xcb_connection_t *conn, xcb_screen_t *screen) {
-  xcb_randr_get_screen_resources_current_cookie_t res_cookie = xcb_randr_get_screen_resources_current(conn, screen->root);
-  xcb_randr_get_screen_resources_current_reply_t *res_reply = xcb_randr_get_screen_resources_current_reply(conn, res_cookie, NULL);
-  if (!res_reply) {
-    fprintf(stderr, "Failed to get RandR screen resources\n");
-    fflush(stderr);
-    return;
+static void map_ewmh_indices(int n) {
+  ewmh_index_count = n;
+  for (int i = 0; i < n; i++)
+    ewmh_index_to_monitor[i] = -1;
+  for (int j = 0; j < monitor_count; j++)
+    ewmh_index_to_monitor[monitors[j].ewmh_index] = j;
+}
+
+static int query_randr_monitors(xcb_connection_t *conn, xcb_screen_t *screen) {
+  xcb_randr_get_monitors_reply_t *mon_reply = WAIT_REPLY(xcb_randr_get_monitors_reply(conn, xcb_randr_get_monitors(conn, screen->root, 1), NULL));
+  if (!mon_reply)
+    return -1;
+
+  int n = xcb_randr_get_monitors_monitors_length(mon_reply);
+  if (n > MAX_MONITORS)
+    n = MAX_MONITORS;
+
+  xcb_randr_monitor_info_t infos[MAX_MONITORS];
+  xcb_randr_output_t first_outputs[MAX_MONITORS];
+  xcb_get_atom_name_cookie_t name_cookies[MAX_MONITORS];
+  xcb_randr_get_output_info_cookie_t info_cookies[MAX_MONITORS];
+
+  xcb_randr_monitor_info_iterator_t iter = xcb_randr_get_monitors_monitors_iterator(mon_reply);
+  for (int i = 0; i < n; i++, xcb_randr_monitor_info_next(&iter)) {
+    infos[i] = *iter.data;
+    first_outputs[i] = xcb_randr_monitor_info_outputs_length(iter.data) > 0 ? xcb_randr_monitor_info_outputs(iter.data)[0] : XCB_NONE;
+    if (infos[i].primary) {
+      primary_output = first_outputs[i];
+      primary_output_valid = 1;
+    }
+    name_cookies[i] = xcb_get_atom_name(conn, infos[i].name);
+    if (first_outputs[i] != XCB_NONE)
+      info_cookies[i] = xcb_randr_get_output_info(conn, first_outputs[i], XCB_CURRENT_TIME);
+  }
+  free(mon_reply);
+
+  char names[MAX_MONITORS][OUTPUT_NAME_MAX];
+  xcb_randr_crtc_t crtcs[MAX_MONITORS];
+  xcb_randr_get_crtc_info_cookie_t crtc_cookies[MAX_MONITORS];
+
+  for (int i = 0; i < n; i++) {
+    xcb_get_atom_name_reply_t *name_reply = WAIT_REPLY(xcb_get_atom_name_reply(conn, name_cookies[i], NULL));
+    names[i][0] = '\0';
+    if (name_reply)
+      copy_output_name(names[i], xcb_get_atom_name_name(name_reply), xcb_get_atom_name_name_length(name_reply));
+    free(name_reply);
+
+    crtcs[i] = XCB_NONE;
+    if (first_outputs[i] != XCB_NONE) {
+      xcb_randr_get_output_info_reply_t *info_reply = WAIT_REPLY(xcb_randr_get_output_info_reply(conn, info_cookies[i], NULL));
+      if (info_reply)
+        crtcs[i] = info_reply->crtc;
+      free(info_reply);
+    }
+
+    if (crtcs[i] != XCB_NONE)
+      crtc_cookies[i] = xcb_randr_get_crtc_info(conn, crtcs[i], XCB_CURRENT_TIME);
   }
 
   monitor_count = 0;
+  for (int i = 0; i < n; i++) {
+    int rotation = XCB_RANDR_ROTATION_ROTATE_0;
+    if (crtcs[i] != XCB_NONE) {
+      xcb_randr_get_crtc_info_reply_t *crtc_reply = WAIT_REPLY(xcb_randr_get_crtc_info_reply(conn, crtc_cookies[i], NULL));
+      if (crtc_reply)
+        rotation = crtc_reply->rotation;
+      free(crtc_reply);
+    }
+
+    if (infos[i].width == 0 || infos[i].height == 0)
+      continue;
+
+    monitor_t *m = &monitors[monitor_count++];
+    m->crtc = crtcs[i];
+    m->output = first_outputs[i];
+    m->x = infos[i].x;
+    m->y = infos[i].y;
+    m->width = infos[i].width;
+    m->height = infos[i].height;
+    m->rotation = rotation;
+    m->ewmh_index = i;
+    m->outputs = infos[i].nOutput;
+    memcpy(m->output_name, names[i], OUTPUT_NAME_MAX);
+  }
+
+  qsort(monitors, monitor_count, sizeof(monitors[0]), cmp_monitor_xy);
+  map_ewmh_indices(n);
+  return 0;
+}
+
+static int query_randr_outputs(xcb_connection_t *conn, xcb_screen_t *screen) {
+  xcb_randr_get_screen_resources_current_cookie_t res_cookie = xcb_randr_get_screen_resources_current(conn, screen->root);
+  xcb_randr_get_screen_resources_current_reply_t *res_reply = WAIT_REPLY(xcb_randr_get_screen_resources_current_reply(conn, res_cookie, NULL));
+  if (!res_reply)
+    return -1;
+
   int num_outputs = xcb_randr_get_screen_resources_current_outputs_length(res_reply);
   xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_current_outputs(res_reply);
-  for (int i = 0; i < num_outputs; i++) {
-    if (monitor_count >= MAX_MONITORS)
-      break;
 
-    xcb_randr_output_t output = outputs[i];
-    xcb_randr_get_output_info_reply_t *info_reply = xcb_randr_get_output_info_reply(conn, xcb_randr_get_output_info(conn, output, XCB_CURRENT_TIME), NULL);
+  xcb_randr_get_output_info_cookie_t *info_cookies = malloc(sizeof(xcb_randr_get_output_info_cookie_t) * num_outputs);
+  xcb_randr_get_output_info_reply_t **info_replies = malloc(sizeof(xcb_randr_get_output_info_reply_t *) * num_outputs);
+  xcb_randr_get_crtc_info_cookie_t *crtc_cookies = malloc(sizeof(xcb_randr_get_crtc_info_cookie_t) * num_outputs);
+  if (num_outputs > 0 && (!info_cookies || !info_replies || !crtc_cookies)) {
+    free(info_cookies);
+    free(info_replies);
+    free(crtc_cookies);
+    free(res_reply);
+    return -1;
+  }
+
+  int refresh_primary = !primary_output_valid;
+  xcb_randr_get_output_primary_cookie_t primary_cookie;
+  if (refresh_primary)
+    primary_cookie = xcb_randr_get_output_primary(conn, screen->root);
 
-    if (!info_reply)
+  for (int i = 0; i < num_outputs; i++)
+    info_cookies[i] = xcb_randr_get_output_info(conn, outputs[i], XCB_CURRENT_TIME);
+
+  if (refresh_primary) {
+    xcb_randr_get_output_primary_reply_t *primary_reply = WAIT_REPLY(xcb_randr_get_output_primary_reply(conn, primary_cookie, NULL));
+    primary_output = primary_reply ? primary_reply->output : XCB_NONE;
+    primary_output_valid = primary_reply != NULL;
+    free(primary_reply);
+  }
+
+  for (int i = 0; i < num_outputs; i++) {
+    info_replies[i] = WAIT_REPLY(xcb_randr_get_output_info_reply(conn, info_cookies[i], NULL));
+    if (!info_replies[i])
       continue;
 
-    if (info_reply->connection != XCB_RANDR_CONNECTION_CONNECTED || info_reply->crtc == XCB_NONE) {
-      free(info_reply);
+    if (info_replies[i]->connection != XCB_RANDR_CONNECTION_CONNECTED || info_replies[i]->crtc == XCB_NONE) {
+      free(info_replies[i]);
+      info_replies[i] = NULL;
       continue;
     }
 
-    xcb_randr_crtc_t crtc = info_reply->crtc;
-    xcb_randr_get_crtc_info_reply_t *crtc_reply = xcb_randr_get_crtc_info_reply(conn, xcb_randr_get_crtc_info(conn, crtc, XCB_CURRENT_TIME), NULL);
+    crtc_cookies[i] = xcb_randr_get_crtc_info(conn, info_replies[i]->crtc, XCB_CURRENT_TIME);
+  }
 
-    if (!crtc_reply || crtc_reply->mode == XCB_NONE || crtc_reply->width <= 0 || crtc_reply->height <= 0) {
-      free(crtc_reply);
-      free(info_reply);
+  monitor_count = 0;
+  for (int i = 0; i < num_outputs; i++) {
+    xcb_randr_get_output_info_reply_t *info_reply = info_replies[i];
+    if (!info_reply)
       continue;
-    }
-
-    monitors[monitor_count].crtc = crtc;
-    monitors[monitor_count].output = output;
-    monitors[monitor_count].x = crtc_reply->x;
-    monitors[monitor_count].y = crtc_reply->y;
-    monitors[monitor_count].width = crtc_reply->width;
-    monitors[monitor_count].height = crtc_reply->height;
-    monitors[monitor_count].rotation = crtc_reply->rotation;
-    monitors[monitor_count].output_name[0] = '\0';
-    get_output_name(conn, output, monitors[monitor_count].output_name);
 
-    monitor_count++;
+    xcb_randr_get_crtc_info_reply_t *crtc_reply = WAIT_REPLY(xcb_randr_get_crtc_info_reply(conn, crtc_cookies[i], NULL));
+
+    if (monitor_count < MAX_MONITORS && crtc_reply && crtc_reply->mode != XCB_NONE && crtc_reply->width > 0 && crtc_reply->height > 0) {
+      monitor_t *m = &monitors[monitor_count++];
+      m->crtc = info_reply->crtc;
+      m->output = outputs[i];
+      m->x = crtc_reply->x;
+      m->y = crtc_reply->y;
+      m->width = crtc_reply->width;
+      m->height = crtc_reply->height;
+      m->rotation = crtc_reply->rotation;
+      m->ewmh_index = -1;
+      m->outputs = 1;
+      copy_output_name(m->output_name, (const char *)xcb_randr_get_output_info_name(info_reply), xcb_randr_get_output_info_name_length(info_reply));
+    }
 
     free(crtc_reply);
     free(info_reply);
   }
+
+  free(info_cookies);
+  free(info_replies);
+  free(crtc_cookies);
   free(res_reply);
 
-  qsort(monitors, monitor_count, sizeof(monitors[0]), cmp_monitor_xy);
+  qsort(monitors, monitor_count, sizeof(monitors[0]), cmp_monitor_xy);
+
+  build_xinerama_map(conn);
+  return 0;
+}
+
+static void update_monitor_totals() {
+  primary_monitor = -1;
+  real_total_width = 0;
+  real_total_height = 0;
+  for (int i = 0; i < monitor_count; i++) {
+    if (primary_output != XCB_NONE && monitors[i].output == primary_output && primary_monitor < 0)
+      primary_monitor = i;
+    monitors[i].name_id = intern_output_name(monitors[i].output_name);
+    int monitor_right = monitors[i].x + monitors[i].width;
+    int monitor_bottom = monitors[i].y + monitors[i].height;
+    if (monitor_right > real_total_width)
+      real_total_width = monitor_right;
+    if (monitor_bottom > real_total_height)
+      real_total_height = monitor_bottom;
+  }
+}
+
+static void query_xrandr(xcb_connection_t *conn, xcb_screen_t *screen) {
+  if (randr_has_monitors) {
+    primary_output = XCB_NONE;
+    primary_output_valid = 0;
+  }
+
+  if ((!randr_has_monitors || query_randr_monitors(conn, screen) != 0) && query_randr_outputs(conn, screen) != 0) {
+    fprintf(stderr, "Failed to get RandR screen resources\n");
+    fflush(stderr);
+    return;
+  }
+
+  update_monitor_totals();
+  fprintf(stderr, "Total screen size: %dx%d\n", real_total_width, real_total_height);
+  fflush(stderr);
+
+  if (real_total_width == 0 || real_total_height == 0) {
+    fprintf(stderr, "Falling back to previous screen size: %dx%d\n", total_width, total_height);
+    fflush(stderr);
+  }
+}
+
+// The CrtcChange payload gives the mode size before rotation.
+static int patch_monitor_crtc(const xcb_randr_crtc_change_t *cc) {
+  int found = 0;
+  int swap = (cc->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270)) != 0;
+
+  for (int i = 0; i < monitor_count; i++) {
+    monitor_t *m = &monitors[i];
+    if (m->crtc != cc->crtc)
+      continue;
+    if (cc->mode == XCB_NONE || m->outputs != 1)
+      return 0;
+
+    m->x = cc->x;
+    m->y = cc->y;
+    m->width = swap ? cc->height : cc->width;
+    m->height = swap ? cc->width : cc->height;
+    m->rotation = cc->rotation;
+    found = 1;
+  }
+
+  return found || cc->mode == XCB_NONE;
+}
+
+static void refresh_patched_monitors(xcb_connection_t *conn) {
+  qsort(monitors, monitor_count, sizeof(monitors[0]), cmp_monitor_xy);
+  if (monitor_count > 0 && monitors[0].ewmh_index < 0)
+    build_xinerama_map(conn);
+  else
+    map_ewmh_indices(ewmh_index_count);
+  update_monitor_totals();
+}
+
+static monitor_t *resolve_monitor_by_name_id(uint16_t name_id) {
+  if (name_id == 0)
+    return NULL;
+
+  for (int i = 0; i < monitor_count; i++) {
+    if (monitors[i].name_id == name_id)
+      return &monitors[i];
+  }
+
+  return NULL;
+}
+
+#define TOUCH_DEVICE_NAME_MAX 128
+
+typedef struct {
+  xcb_input_device_id_t deviceid;
+  uint16_t output_name_id;
+  int has_matrix;
+  float matrix[9];
+} touch_device_t;
+
+typedef struct {
+  char device_name[TOUCH_DEVICE_NAME_MAX];
+  uint16_t output_name_id;
+} touch_mapping_t;
+
+static touch_device_t *touch_devices = NULL;
+static int touch_device_count = 0;
+static int touch_device_capacity = 0;
+static touch_mapping_t *touch_mappings = NULL;
+static int touch_mapping_count = 0;
+
+static void load_touch_mappings(void) {
+  const char *home = getenv("HOME");
+  if (!home)
+    return;
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/.sinwm-touch", home);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+
+  char line[OUTPUT_NAME_MAX + TOUCH_DEVICE_NAME_MAX + 2];
+  int capacity = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *device = strchr(line, ' ');
+    if (line[0] == '#' || !device)
+      continue;
+    *device++ = '\0';
+    device += strspn(device, " \t");
+    if (!device[0])
+      continue;
+
+    if (touch_mapping_count == capacity) {
+      capacity = capacity ? capacity * 2 : 4;
+      touch_mapping_t *grown = realloc(touch_mappings, sizeof(*touch_mappings) * capacity);
+      if (!grown)
+        break;
+      touch_mappings = grown;
+    }
+
+    touch_mapping_t *m = &touch_mappings[touch_mapping_count++];
+    snprintf(m->device_name, sizeof(m->device_name), "%s", device);
+    m->output_name_id = intern_output_name(line);
+  }
+
+  fclose(fp);
+}
+
+static uint16_t touch_output_for(const char *name, int length) {
+  for (int i = 0; i < touch_mapping_count; i++) {
+    const char *d = touch_mappings[i].device_name;
+    if ((int)strlen(d) == length && memcmp(d, name, length) == 0)
+      return touch_mappings[i].output_name_id;
+  }
+  return 0;
+}
+
+static int is_touch_device(xcb_input_xi_device_info_t *info) {
+  if (info->type != XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER)
+    return 0;
 
-  build_xinerama_map(conn);
+  xcb_input_device_class_iterator_t class_iter = xcb_input_xi_device_info_classes_iterator(info);
+  while (class_iter.rem) {
+    if (class_iter.data->type == XCB_INPUT_DEVICE_CLASS_TYPE_TOUCH)
+      return 1;
+    xcb_input_device_class_next(&class_iter);
+  }
+  return 0;
+}
 
-  real_total_width = 0;
-  real_total_height = 0;
-  for (int i = 0; i < monitor_count; i++) {
-    int monitor_right = monitors[i].x + monitors[i].width;
-    int monitor_bottom = monitors[i].y + monitors[i].height;
-    if (monitor_right > real_total_width)
-      real_total_width = monitor_right;
-    if (monitor_bottom > real_total_height)
-      real_total_height = monitor_bottom;
+static touch_device_t *find_touch_device(xcb_input_device_id_t deviceid) {
+  for (int i = 0; i < touch_device_count; i++) {
+    if (touch_devices[i].deviceid == deviceid)
+      return &touch_devices[i];
   }
-  fprintf(stderr, "Total screen size: %dx%d\n", real_total_width, real_total_height);
-  fflush(stderr);
+  return NULL;
+}
 
-  if (real_total_width == 0 || real_total_height == 0) {
-    fprintf(stderr, "Falling back to previous screen size: %dx%d\n", total_width, total_height);
-    fflush(stderr);
+static touch_device_t *add_touch_device(xcb_input_xi_device_info_t *info) {
+  touch_device_t *d = find_touch_device(info->deviceid);
+  if (d)
+    return d;
+
+  if (touch_device_count == touch_device_capacity) {
+    int capacity = touch_device_capacity ? touch_device_capacity * 2 : 4;
+    touch_device_t *grown = realloc(touch_devices, sizeof(*touch_devices) * capacity);
+    if (!grown)
+      return NULL;
+    touch_devices = grown;
+    touch_device_capacity = capacity;
   }
+
+  d = &touch_devices[touch_device_count++];
+  memset(d, 0, sizeof(*d));
+  d->deviceid = info->deviceid;
+  d->output_name_id = touch_output_for(xcb_input_xi_device_info_name(info), xcb_input_xi_device_info_name_length(info));
+  return d;
+}
+
+static void remove_touch_device(xcb_input_device_id_t deviceid) {
+  touch_device_t *d = find_touch_device(deviceid);
+  if (d)
+    *d = touch_devices[--touch_device_count];
 }
 
-static void set_touch_device_matrix(xcb_connection_t *conn, xcb_input_device_id_t deviceid, monitor_t *monitor) {
+static void touch_matrix(monitor_t *monitor, float out[9]) {
   int r = monitor->rotation;
-  xcb_input_xi_change_property(
-    conn,
-    deviceid,
-    XCB_PROP_MODE_REPLACE,
-    32,
-    atom_coordinate_transformation_matrix,
-    atom_float,
-    9,
+  const float *m =
       r == XCB_RANDR_ROTATION_ROTATE_90  ? m90
     : r == XCB_RANDR_ROTATION_ROTATE_180 ? m180
     : r == XCB_RANDR_ROTATION_ROTATE_270 ? m270
-    : m0
-  );
-  xcb_flush(conn);
+    : m0;
+
+  float sx = (float)monitor->width / total_width;
+  float sy = (float)monitor->height / total_height;
+  float tx = (float)monitor->x / total_width;
+  float ty = (float)monitor->y / total_height;
+
+  for (int i = 0; i < 3; i++) {
+    out[i] = sx * m[i] + tx * m[6 + i];
+    out[3 + i] = sy * m[3 + i] + ty * m[6 + i];
+    out[6 + i] = m[6 + i];
+  }
 }
 
-static void update_touch_devices(xcb_connection_t *conn) {
+static void apply_touch_device(xcb_connection_t *conn, touch_device_t *d, monitor_t *primary) {
+  monitor_t *target = resolve_monitor_by_name_id(d->output_name_id);
+  if (!target)
+    target = primary;
+  if (!target || total_width <= 0 || total_height <= 0)
+    return;
+
+  float matrix[9];
+  touch_matrix(target, matrix);
+  if (d->has_matrix && memcmp(matrix, d->matrix, sizeof(matrix)) == 0)
+    return;
+
+  memcpy(d->matrix, matrix, sizeof(matrix));
+  d->has_matrix = 1;
+  xcb_input_xi_change_property(conn, d->deviceid, XCB_PROP_MODE_REPLACE, 32,
+    atom_coordinate_transformation_matrix, atom_float, 9, matrix);
+}
+
+static monitor_t *touch_default_monitor(void) {
   if (monitor_count == 0)
+    return NULL;
+
+  monitor_t *primary = get_primary_monitor();
+  return primary ? primary : &monitors[0];
+}
+
+static void update_touch_devices(xcb_connection_t *conn) {
+  if (touch_device_count == 0 || monitor_count == 0)
     return;
 
-  xcb_screen_iterator_t siter = xcb_setup_roots_iterator(xcb_get_setup(conn));
-  xcb_screen_t *screen = siter.data;
-  monitor_t *target = get_primary_monitor(conn, screen);
-  if (!target)
-    target = &monitors[0];
+  monitor_t *primary = touch_default_monitor();
+  for (int i = 0; i < touch_device_count; i++)
+    apply_touch_device(conn, &touch_devices[i], primary);
+}
+
+static void finish_primary_output(xcb_connection_t *conn, void *reply, void *data) {
+  xcb_randr_get_output_primary_reply_t *primary_reply = reply;
+  if (!primary_reply || primary_output_valid)
+    return;
+  int previous = primary_monitor;
+  primary_output = primary_reply->output;
+  primary_output_valid = 1;
+  update_monitor_totals();
+  if (primary_monitor != previous)
+    update_touch_devices(conn);
+}
+
+static void refresh_primary_output(xcb_connection_t *conn, xcb_screen_t *screen) {
+  xcb_randr_get_output_primary_cookie_t cookie = xcb_randr_get_output_primary(conn, screen->root);
+  continue_after(conn, cookie.sequence, finish_primary_output, NULL);
+}
+
+static void load_touch_devices(xcb_connection_t *conn) {
+  load_touch_mappings();
 
   xcb_input_xi_query_device_cookie_t cookie = xcb_input_xi_query_device(conn, XCB_INPUT_DEVICE_ALL);
-  xcb_input_xi_query_device_reply_t *reply = xcb_input_xi_query_device_reply(conn, cookie, NULL);
+  xcb_input_xi_query_device_reply_t *reply = WAIT_REPLY(xcb_input_xi_query_device_reply(conn, cookie, NULL));
   if (!reply)
     return;
 
   xcb_input_xi_device_info_iterator_t diter = xcb_input_xi_query_device_infos_iterator(reply);
-
   while (diter.rem) {
-    xcb_input_device_id_t deviceid = diter.data->deviceid;
-    if (diter.data->type == XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER) {
-      xcb_input_device_class_iterator_t class_iter = xcb_input_xi_device_info_classes_iterator(diter.data);
-      while (class_iter.rem) {
-        xcb_input_device_class_t *device_class = class_iter.data;
-        if (device_class->type == XCB_INPUT_DEVICE_CLASS_TYPE_TOUCH)
-          set_touch_device_matrix(conn, deviceid, target);
-        xcb_input_device_class_next(&class_iter);
-      }
-    }
+    if (is_touch_device(diter.data))
+      add_touch_device(diter.data);
     xcb_input_xi_device_info_next(&diter);
   }
-
   free(reply);
+
+  update_touch_devices(conn);
 }
 
-static monitor_t *resolve_monitor_by_name(const char *name) {
-  if (!name || !name[0])
-    return NULL;
+static void finish_touch_device(xcb_connection_t *conn, void *reply, void *data) {
+  (void)data;
+  xcb_input_xi_query_device_reply_t *r = reply;
+  if (!r)
+    return;
 
-  for (int i = 0; i < monitor_count; i++) {
-    if (strcmp(monitors[i].output_name, name) == 0)
-      return &monitors[i];
+  xcb_input_xi_device_info_iterator_t diter = xcb_input_xi_query_device_infos_iterator(r);
+  while (diter.rem) {
+    if (is_touch_device(diter.data)) {
+      touch_device_t *d = add_touch_device(diter.data);
+      if (d)
+        apply_touch_device(conn, d, touch_default_monitor());
+    }
+    xcb_input_xi_device_info_next(&diter);
   }
+}
 
-  return NULL;
+static void handle_xi_hierarchy(xcb_connection_t *conn, xcb_input_hierarchy_event_t *event) {
+  xcb_input_hierarchy_info_t *infos = xcb_input_hierarchy_infos(event);
+  int count = xcb_input_hierarchy_infos_length(event);
+
+  for (int i = 0; i < count; i++) {
+    uint32_t flags = infos[i].flags;
+    if (flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED | XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED)) {
+      remove_touch_device(infos[i].deviceid);
+    } else if (flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED | XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED)) {
+      xcb_input_xi_query_device_cookie_t cookie = xcb_input_xi_query_device(conn, infos[i].deviceid);
+      continue_after(conn, cookie.sequence, finish_touch_device, NULL);
+    }
+  }
 }
 
 static int fullscreen_bounds(monitor_t *ms[4], int *out_x, int *out_y, int *out_width, int *out_height) {
@@ -709,12 +3405,12 @@ static int fullscreen_bounds(monitor_t *ms[4], int *out_x, int *out_y, int *out_
   return 0;
 }
 
-static int calculate_fullscreen_geometry_names(const char names[4][OUTPUT_NAME_MAX], int *x1, int *y1, int *x2, int *y2) {
+static int calculate_fullscreen_geometry_names(const uint16_t names[4], int *x1, int *y1, int *x2, int *y2) {
   monitor_t *ms[4] = {
-    resolve_monitor_by_name(names[0]),
-    resolve_monitor_by_name(names[1]),
-    resolve_monitor_by_name(names[2]),
-    resolve_monitor_by_name(names[3])
+    resolve_monitor_by_name_id(names[0]),
+    resolve_monitor_by_name_id(names[1]),
+    resolve_monitor_by_name_id(names[2]),
+    resolve_monitor_by_name_id(names[3])
   };
 
   int x, y, width, height;
@@ -744,165 +3440,105 @@ static monitor_t *resolve_monitor_ref(int ref) {
   return NULL;
 }
 
-static int add_fullscreen_window(xcb_connection_t *conn, xcb_window_t window) {
-  if (fullscreen_count >= MAX_WINDOWS) {
-    fprintf(stderr, "Maximum number of fullscreen windows reached.\n");
-    fflush(stderr);
-    return -1;
+static int window_geometry(xcb_connection_t *conn, xcb_window_t window, xcb_rectangle_t *out) {
+  client_t *c = find_client(window);
+  if (c && (c->flags & CLIENT_HAS_GEOMETRY)) {
+    *out = c->geometry;
+    return 0;
   }
 
-  xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, window);
-  xcb_get_geometry_reply_t *geom_reply = xcb_get_geometry_reply(conn, geom_cookie, NULL);
-  if (!geom_reply) {
+  xcb_get_geometry_reply_t *geom_reply = WAIT_REPLY(xcb_get_geometry_reply(conn, xcb_get_geometry(conn, window), NULL));
+  if (!geom_reply)
+    return -1;
+
+  *out = (xcb_rectangle_t){ geom_reply->x, geom_reply->y, geom_reply->width, geom_reply->height };
+  free(geom_reply);
+  if (c)
+    update_client_geometry(c, out->x, out->y, out->width, out->height);
+  return 0;
+}
+
+static int add_fullscreen_window(xcb_connection_t *conn, xcb_window_t window) {
+  xcb_rectangle_t original_geometry;
+  if (window_geometry(conn, window, &original_geometry) != 0) {
     fprintf(stderr, "Failed to get geometry for window 0x%08x.\n", window);
     fflush(stderr);
     return -1;
   }
 
-  fs_windows[fullscreen_count].window = window;
-  fs_windows[fullscreen_count].original_geometry.x = geom_reply->x;
-  fs_windows[fullscreen_count].original_geometry.y = geom_reply->y;
-  fs_windows[fullscreen_count].original_geometry.width = geom_reply->width;
-  fs_windows[fullscreen_count].original_geometry.height = geom_reply->height;
-  fs_windows[fullscreen_count].has_monitors = 0;
-  fs_windows[fullscreen_count].is_general_fullscreen = 0;
-  fs_windows[fullscreen_count].is_monitor_fullscreen = 0;
-  for (int i = 0; i < 4; i++)
-    fs_windows[fullscreen_count].monitor_output_names[i][0] = '\0';
-  free(geom_reply);
-  fullscreen_count++;
-  return fullscreen_count - 1;
+  int index = track_fullscreen_window(window, &original_geometry);
+  if (index == -1) {
+    fprintf(stderr, "Out of memory tracking fullscreen window 0x%08x.\n", window);
+    fflush(stderr);
+  }
+  return index;
 }
 
-static void add_net_wm_state_atom(xcb_connection_t *conn, xcb_window_t win, xcb_atom_t add_atom) {
-  xcb_get_property_cookie_t c = xcb_get_property(conn, 0, win, atom_net_wm_state, XCB_ATOM_ATOM, 0, 32);
-  xcb_get_property_reply_t *r = xcb_get_property_reply(conn, c, NULL);
+static client_t *client_states(xcb_connection_t *conn, xcb_window_t window) {
+  client_query(conn, window, CLIENT_FULLSCREEN | CLIENT_ABOVE);
+  return find_client(window);
+}
 
-  xcb_atom_t out[32];
-  int out_n = 0;
-  int found = 0;
+// Each write's PropertyNotify is swallowed in handle_property_notify.
+static void write_net_wm_state(xcb_connection_t *conn, client_t *c) {
+  update_state_flags(c);
+  c->state_writes++;
+  if (c->state_count == 0)
+    xcb_delete_property(conn, c->window, atom_net_wm_state);
+  else
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, c->window, atom_net_wm_state, XCB_ATOM_ATOM, 32, c->state_count, c->states);
+}
 
-  if (r) {
-    int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
-    xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
+static void add_net_wm_state_atom(xcb_connection_t *conn, xcb_window_t win, xcb_atom_t add_atom) {
+  client_t *c = client_states(conn, win);
+  if (!c)
+    return;
 
-    for (int i = 0; i < n && out_n < 32; i++) {
-      out[out_n++] = atoms[i];
-      if (atoms[i] == add_atom)
-        found = 1;
-    }
-    free(r);
+  for (uint32_t i = 0; i < c->state_count; i++) {
+    if (c->states[i] == add_atom)
+      return;
   }
 
-  if (!found && out_n < 32)
-    out[out_n++] = add_atom;
-
-  xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, atom_net_wm_state, XCB_ATOM_ATOM, 32, out_n, out);
+  if (reserve_states(c, c->state_count + 1) != 0)
+    return;
+  c->states[c->state_count++] = add_atom;
+  write_net_wm_state(conn, c);
 }
 
 static void remove_net_wm_state_atom(xcb_connection_t *conn, xcb_window_t win, xcb_atom_t remove_atom) {
-  xcb_get_property_cookie_t c = xcb_get_property(conn, 0, win, atom_net_wm_state, XCB_ATOM_ATOM, 0, 32);
-  xcb_get_property_reply_t *r = xcb_get_property_reply(conn, c, NULL);
-  if (!r) return;
-
-  int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
-  xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
+  client_t *c = client_states(conn, win);
+  if (!c)
+    return;
 
-  xcb_atom_t out[32];
-  int out_n = 0;
-  for (int i = 0; i < n && out_n < 32; i++) {
-    if (atoms[i] != remove_atom)
-      out[out_n++] = atoms[i];
+  uint32_t out_n = 0;
+  for (uint32_t i = 0; i < c->state_count; i++) {
+    if (c->states[i] != remove_atom)
+      c->states[out_n++] = c->states[i];
   }
+  if (out_n == c->state_count)
+    return;
 
-  if (out_n == 0)
-    xcb_delete_property(conn, win, atom_net_wm_state);
-  else
-    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, atom_net_wm_state, XCB_ATOM_ATOM, 32, out_n, out);
-
-  free(r);
+  c->state_count = out_n;
+  write_net_wm_state(conn, c);
 }
 
 static void remove_fullscreen_window(xcb_connection_t *conn, xcb_window_t window) {
-  int index = -1;
-  for (int i = 0; i < fullscreen_count; i++) {
-    if (fs_windows[i].window == window) {
-      index = i;
-      break;
-    }
-  }
+  int index = find_fullscreen_window(window);
   if (index != -1) {
     remove_net_wm_state_atom(conn, window, atom_net_wm_state_fullscreen);
-    uint32_t values[] = {
-      fs_windows[index].original_geometry.x,
-      fs_windows[index].original_geometry.y,
-      fs_windows[index].original_geometry.width,
-      fs_windows[index].original_geometry.height
-    };
-    uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
-                    XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-    xcb_configure_window(conn, window, mask, values);
-
-    send_configure_notify(conn, window, fs_windows[index].original_geometry.x, fs_windows[index].original_geometry.y, fs_windows[index].original_geometry.width, fs_windows[index].original_geometry.height);
+    xcb_rectangle_t g = fs_geometry[index].original_geometry;
+    configure_window_geometry(conn, window, g.x, g.y, g.width, g.height);
 
-    fs_windows[index].is_general_fullscreen = 0;
-    fs_windows[index].is_monitor_fullscreen = 0;
-
-    for (int i = index; i < fullscreen_count - 1; i++)
-      fs_windows[i] = fs_windows[i + 1];
-    fullscreen_count--;
+    untrack_fullscreen_window(index);
   }
 }
 
 static int window_supports_wm_delete(xcb_connection_t *conn, xcb_window_t window) {
-  xcb_get_property_cookie_t c = xcb_get_property(conn, 0, window, atom_wm_protocols, XCB_ATOM_ATOM, 0, 8);
-  xcb_get_property_reply_t *r = xcb_get_property_reply(conn, c, NULL);
-
-  if (!r)
-    return 0;
-
-  int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
-  xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
-
-  int supports = 0;
-  for (int i = 0; i < n; i++) {
-    if (atoms[i] == atom_wm_delete_window) {
-      supports = 1;
-      break;
-    }
-  }
-
-  free(r);
-  return supports;
+  return client_query(conn, window, CLIENT_DELETE_WINDOW) != 0;
 }
 
 static int window_is_splash(xcb_connection_t *conn, xcb_window_t window) {
-  xcb_get_property_cookie_t c =
-    xcb_get_property(conn, 0,
-      window,
-      atom_net_wm_window_type,
-      XCB_ATOM_ATOM,
-      0, 8);
-
-  xcb_get_property_reply_t *r =
-    xcb_get_property_reply(conn, c, NULL);
-
-  if (!r)
-    return 0;
-
-  int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
-  xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
-
-  int is_splash = 0;
-  for (int i = 0; i < n; i++) {
-    if (atoms[i] == atom_net_wm_window_type_splash) {
-      is_splash = 1;
-      break;
-    }
-  }
-
-  free(r);
-  return is_splash;
+  return client_query(conn, window, CLIENT_SPLASH) != 0;
 }
 
 static void send_wm_delete(xcb_connection_t *conn, xcb_window_t window) {
@@ -915,122 +3551,47 @@ static void send_wm_delete(xcb_connection_t *conn, xcb_window_t window) {
   ev.data.data32[0] = atom_wm_delete_window;
   ev.data.data32[1] = XCB_CURRENT_TIME;
   xcb_send_event(conn, 0, window, XCB_EVENT_MASK_NO_EVENT, (char *)&ev);
-  xcb_flush(conn);
 }
 
 static int window_is_dock(xcb_connection_t *conn, xcb_window_t window) {
-  xcb_get_property_cookie_t c = xcb_get_property(conn, 0, window, atom_net_wm_window_type, XCB_ATOM_ATOM, 0, 8);
-  xcb_get_property_reply_t *r = xcb_get_property_reply(conn, c, NULL);
-
-  if (!r)
-    return 0;
-
-  int n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
-  xcb_atom_t *atoms = (xcb_atom_t *)xcb_get_property_value(r);
-
-  int is_dock = 0;
-  for (int i = 0; i < n; i++) {
-    if (atoms[i] == atom_net_wm_window_type_dock) {
-      is_dock = 1;
-      break;
-    }
-  }
-
-  free(r);
-  return is_dock;
+  return client_query(conn, window, CLIENT_DOCK) != 0;
 }
 
-static void adjust_windows_within_bounds(xcb_connection_t *conn, xcb_screen_t *screen) {
-  xcb_query_tree_cookie_t tree_cookie = xcb_query_tree(conn, screen->root);
-  xcb_query_tree_reply_t *tree_reply = xcb_query_tree_reply(conn, tree_cookie, NULL);
-  if (!tree_reply) {
-    fprintf(stderr, "Failed to query window tree.\n");
-    fflush(stderr);
-    return;
+typedef struct {
+  xcb_window_t target;
+  xcb_timestamp_t timestamp;
+} activate_context_t;
+
+static void activate_window(xcb_connection_t *conn, xcb_window_t target, xcb_timestamp_t timestamp) {
+  client_t *c = find_client(target);
+  if (c && (c->flags & CLIENT_STACKED)) {
+    stack_raise(c);
+  } else {
+    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
+    xcb_configure_window(conn, target, XCB_CONFIG_WINDOW_STACK_MODE, stack);
   }
+  set_input_focus_ts(conn, target, timestamp);
+}
 
-  monitor_t *primary = get_primary_monitor(conn, screen);
-  if (!primary)
-    primary = (monitor_count > 0) ? &monitors[0] : NULL;
-
-  int len = xcb_query_tree_children_length(tree_reply);
-  xcb_window_t *children = xcb_query_tree_children(tree_reply);
-
-  for (int i = 0; i < len; i++) {
-    xcb_window_t child = children[i];
-
-    if (is_fullscreen_window(child))
-      continue;
-
-    xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, child);
-    xcb_get_geometry_reply_t *geom_reply = xcb_get_geometry_reply(conn, geom_cookie, NULL);
-    if (!geom_reply)
-      continue;
-
-    if (window_is_dock(conn, child) || window_is_splash(conn, child)) {
-      free(geom_reply);
-      continue;
-    };
-
-    xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(conn, xcb_get_window_attributes(conn, child), NULL);
-
-    if (!attr || attr->override_redirect) {
-      free(attr);
-      free(geom_reply);
-      continue;
-    }
-    free(attr);
-
-    int window_x = geom_reply->x;
-    int window_y = geom_reply->y;
-    int window_width = geom_reply->width;
-    int window_height = geom_reply->height;
-
-    int window_right = window_x + window_width;
-    int window_bottom = window_y + window_height;
-
-    int on_screen = 0;
-
-    for (int j = 0; j < monitor_count; j++) {
-      int monitor_x = monitors[j].x;
-      int monitor_y = monitors[j].y;
-      int monitor_right = monitor_x + monitors[j].width;
-      int monitor_bottom = monitor_y + monitors[j].height;
-
-      if (window_right > monitor_x && window_x < monitor_right && window_bottom > monitor_y && window_y < monitor_bottom) {
-        on_screen = 1;
-        break;
-      }
-    }
-
-    if (!on_screen) {
-      if (!primary) {
-        free(geom_reply);
-        continue;
-      }
-
-      int new_x = primary->x;
-      int new_y = primary->y;
-
-      if (window_width > primary->width)
-        window_width = primary->width;
-      if (window_height > primary->height)
-        window_height = primary->height;
+static void finish_activate(xcb_connection_t *conn, void *reply, void *data) {
+  activate_context_t *ctx = data;
+  xcb_get_window_attributes_reply_t *attr = reply;
 
-      uint32_t values[] = { new_x, new_y, window_width, window_height };
-      uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-      xcb_configure_window(conn, child, mask, values);
-      send_configure_notify(conn, child, new_x, new_y, window_width, window_height);
-    }
+  if (!attr || attr->map_state != XCB_MAP_STATE_VIEWABLE || attr->override_redirect)
+    return;
 
-    free(geom_reply);
-  }
+  activate_window(conn, ctx->target, ctx->timestamp);
+}
 
-  free(tree_reply);
-  xcb_flush(conn);
+static void raise_unstacked(xcb_connection_t *conn, xcb_window_t window) {
+  client_t *c = find_client(window);
+  if (c && (c->flags & CLIENT_STACKED))
+    return;
+  uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
+  xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_STACK_MODE, stack);
 }
 
-static void handle_client_message(xcb_connection_t *conn, xcb_client_message_event_t *cm, xcb_screen_t *screen) {
+static void apply_client_message(xcb_connection_t *conn, xcb_client_message_event_t *cm, xcb_screen_t *screen) {
   if (cm->type == atom_net_wm_state) {
     xcb_atom_t atom1 = cm->data.data32[1];
     xcb_atom_t atom2 = cm->data.data32[2];
@@ -1038,10 +3599,9 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
 
     if (atom1 == atom_net_wm_state_above || atom2 == atom_net_wm_state_above) {
       if (action == 1) {
-        uint32_t values[] = { XCB_STACK_MODE_ABOVE };
-        xcb_configure_window(conn, cm->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
         add_net_wm_state_atom(conn, cm->window, atom_net_wm_state_above);
         add_to_always_on_top(cm->window);
+        raise_unstacked(conn, cm->window);
       } else if (action == 0) {
         remove_net_wm_state_atom(conn, cm->window, atom_net_wm_state_above);
         remove_from_always_on_top(cm->window);
@@ -1050,10 +3610,9 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
           remove_net_wm_state_atom(conn, cm->window, atom_net_wm_state_above);
           remove_from_always_on_top(cm->window);
         } else {
-          uint32_t values[] = { XCB_STACK_MODE_ABOVE };
-          xcb_configure_window(conn, cm->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
           add_net_wm_state_atom(conn, cm->window, atom_net_wm_state_above);
           add_to_always_on_top(cm->window);
+          raise_unstacked(conn, cm->window);
         }
       }
     }
@@ -1062,15 +3621,8 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
       return;
 
     if (atom1 == atom_net_wm_state_fullscreen || atom2 == atom_net_wm_state_fullscreen) {
-      int index = -1;
-      for (int i = 0; i < fullscreen_count; i++) {
-        if (fs_windows[i].window == cm->window) {
-          index = i;
-          break;
-        }
-      }
-
-      int is_monitor_fullscreen = (index != -1) ? fs_windows[index].is_monitor_fullscreen : 0;
+      int index = find_fullscreen_window(cm->window);
+      int is_monitor_fullscreen = (index != -1) ? (fs_windows[index].flags & FULLSCREEN_MONITOR) != 0 : 0;
       if (is_monitor_fullscreen)
         return;
 
@@ -1081,34 +3633,24 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
             return;
           }
         }
-        fs_windows[index].is_general_fullscreen = 1;
+        fs_windows[index].flags |= FULLSCREEN_GENERAL;
 
-        xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, cm->window);
-        xcb_get_geometry_reply_t *geom_reply = xcb_get_geometry_reply(conn, geom_cookie, NULL);
+        xcb_rectangle_t g;
         monitor_t *target_monitor = NULL;
-        if (geom_reply) {
+        if (window_geometry(conn, cm->window, &g) == 0) {
           for (int i = 0; i < monitor_count; i++) {
-            if (geom_reply->x >= monitors[i].x && geom_reply->x < monitors[i].x + monitors[i].width &&
-                geom_reply->y >= monitors[i].y && geom_reply->y < monitors[i].y + monitors[i].height) {
+            if (g.x >= monitors[i].x && g.x < monitors[i].x + monitors[i].width &&
+                g.y >= monitors[i].y && g.y < monitors[i].y + monitors[i].height) {
               target_monitor = &monitors[i];
               break;
             }
           }
-          free(geom_reply);
         }
         if (!target_monitor && monitor_count > 0)
           target_monitor = &monitors[0];
 
         if (target_monitor) {
-          uint32_t x = target_monitor->x;
-          uint32_t y = target_monitor->y;
-          uint32_t width = target_monitor->width;
-          uint32_t height = target_monitor->height;
-
-          uint32_t values[] = { x, y, width, height };
-          uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-          xcb_configure_window(conn, cm->window, mask, values);
-          send_configure_notify(conn, cm->window, (int)x, (int)y, (int)width, (int)height);
+          configure_window_geometry(conn, cm->window, target_monitor->x, target_monitor->y, target_monitor->width, target_monitor->height);
           add_net_wm_state_atom(conn, cm->window, atom_net_wm_state_fullscreen);
         }
       } else if (action == 0 || (action == 2 && index != -1)) {
@@ -1117,27 +3659,24 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
       }
     }
 
-    xcb_flush(conn);
   } else if (cm->type == atom_net_active_window) {
     xcb_window_t target = cm->window;
     if (target == XCB_WINDOW_NONE || target == screen->root)
       return;
 
-    xcb_timestamp_t timestamp = cm->data.data32[1];
-    xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(conn, xcb_get_window_attributes(conn, target), NULL);
-
-    if (!attr)
-      return;
-
-    if (attr->map_state != XCB_MAP_STATE_VIEWABLE || attr->override_redirect) {
-      free(attr);
+    client_t *c = find_client(target);
+    if (c && (c->flags & CLIENT_MAPPED) && !(c->stale & SOURCE_ATTRIBUTES)) {
+      if (!(c->flags & CLIENT_OVERRIDE_REDIRECT))
+        activate_window(conn, target, cm->data.data32[1]);
       return;
     }
-    free(attr);
 
-    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, target, XCB_CONFIG_WINDOW_STACK_MODE, stack);
-    set_input_focus_ts(conn, target, timestamp);
+    activate_context_t *ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+      return;
+    ctx->target = target;
+    ctx->timestamp = cm->data.data32[1];
+    continue_after(conn, xcb_get_window_attributes(conn, target).sequence, finish_activate, ctx);
   } else if (cm->type == atom_net_wm_fullscreen_monitors) {
     int xs[4];
     xs[0] = cm->data.data32[0];
@@ -1146,32 +3685,17 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
     xs[3] = cm->data.data32[3];
 
     if (xs[0] == -1 && xs[1] == -1 && xs[2] == -1 && xs[3] == -1) {
-      uint32_t values[] = { 0, 0, total_width, total_height };
-      uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-
-      xcb_configure_window(conn, cm->window, mask, values);
-      send_configure_notify(conn, cm->window, 0, 0, total_width, total_height);
+      configure_window_geometry(conn, cm->window, 0, 0, total_width, total_height);
 
       add_net_wm_state_atom(conn, cm->window, atom_net_wm_state_fullscreen);
 
-      int index = -1;
-      for (int i = 0; i < fullscreen_count; i++) {
-        if (fs_windows[i].window == cm->window) {
-          index = i;
-          break;
-        }
-      }
-
+      int index = find_fullscreen_window(cm->window);
       if (index == -1)
         index = add_fullscreen_window(conn, cm->window);
 
-      if (index != -1) {
-        fs_windows[index].has_monitors = 0;
-        fs_windows[index].is_general_fullscreen = 1;
-        fs_windows[index].is_monitor_fullscreen = 0;
-      }
+      if (index != -1)
+        fs_windows[index].flags = FULLSCREEN_GENERAL;
 
-      xcb_flush(conn);
       return;
     }
 
@@ -1192,150 +3716,375 @@ static void handle_client_message(xcb_connection_t *conn, xcb_client_message_eve
       return;
     }
 
-    uint32_t values[] = { (uint32_t)fs_x, (uint32_t)fs_y, (uint32_t)fs_width, (uint32_t)fs_height };
-    uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-
-    xcb_configure_window(conn, cm->window, mask, values);
-    send_configure_notify(conn, cm->window, fs_x, fs_y, fs_width, fs_height);
+    configure_window_geometry(conn, cm->window, fs_x, fs_y, fs_width, fs_height);
 
     add_net_wm_state_atom(conn, cm->window,atom_net_wm_state_fullscreen);
 
-    int index = -1;
-    for (int i = 0; i < fullscreen_count; i++) {
-      if (fs_windows[i].window == cm->window) {
-        index = i;
-        break;
-      }
+    int index = find_fullscreen_window(cm->window);
+    if (index == -1)
+      index = add_fullscreen_window(conn, cm->window);
+
+    if (index != -1) {
+      for (int i = 0; i < 4; i++)
+        fs_geometry[index].monitor_names[i] = ms[i]->name_id;
+      fs_windows[index].flags = FULLSCREEN_HAS_MONITORS | FULLSCREEN_MONITOR;
     }
 
-    if (index == -1)
-      index = add_fullscreen_window(conn, cm->window);
+  } else if (cm->type == atom_net_close_window) {
+    if (window_is_dock(conn, cm->window) || window_is_splash(conn, cm->window))
+      return;
+
+    xcb_window_t target = cm->window;
+    if (window_supports_wm_delete(conn, target))
+      send_wm_delete(conn, target);
+    else
+      xcb_kill_client(conn, target);
+
+    return;
+  }
+}
+
+typedef struct {
+  xcb_client_message_event_t event;
+  client_cookies_t client_cookies;
+  int has_geometry_cookie;
+  xcb_get_geometry_cookie_t geometry;
+  int tracked;
+} client_message_context_t;
+
+// While any message is deferred, later ones queue behind it to keep order.
+static int deferred_client_messages = 0;
+
+static void finish_client_message(xcb_connection_t *conn, void *reply, void *data) {
+  client_message_context_t *ctx = data;
+  xcb_window_t window = ctx->event.window;
+  client_t *c = find_client(window);
+
+  client_t gone = { 0 };
+  if (ctx->client_cookies.sources) {
+    client_collect(conn, c ? c : &gone, &ctx->client_cookies);
+    free(gone.states);
+  }
+  if (ctx->has_geometry_cookie) {
+    xcb_get_geometry_reply_t *geom_reply = xcb_get_geometry_reply(conn, ctx->geometry, NULL);
+    if (geom_reply && c)
+      update_client_geometry(c, geom_reply->x, geom_reply->y, geom_reply->width, geom_reply->height);
+    free(geom_reply);
+  }
+
+  deferred_client_messages--;
+  if (ctx->tracked && !c)
+    return;
+
+  xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+  apply_client_message(conn, &ctx->event, screen);
+}
+
+static void handle_client_message(xcb_connection_t *conn, xcb_client_message_event_t *cm, xcb_screen_t *screen) {
+  uint32_t want = 0;
+  int geometry = 0;
+  if (cm->type == atom_net_wm_state) {
+    want = CLIENT_FULLSCREEN | CLIENT_ABOVE | CLIENT_DOCK | CLIENT_SPLASH;
+    geometry = 1;
+  } else if (cm->type == atom_net_wm_fullscreen_monitors) {
+    want = CLIENT_FULLSCREEN | CLIENT_ABOVE;
+    geometry = 1;
+  } else if (cm->type == atom_net_close_window) {
+    want = CLIENT_DOCK | CLIENT_SPLASH | CLIENT_DELETE_WINDOW;
+  }
+
+  client_t *c = want ? add_client(cm->window) : NULL;
+  uint32_t sources = c ? c->stale & flag_sources(want) : 0;
+  geometry = c && geometry && !(c->flags & CLIENT_HAS_GEOMETRY);
+  if (!sources && !geometry && deferred_client_messages == 0) {
+    apply_client_message(conn, cm, screen);
+    return;
+  }
+
+  client_message_context_t *ctx = malloc(sizeof(*ctx));
+  if (!ctx) {
+    drain_continuations(conn);
+    apply_client_message(conn, cm, screen);
+    return;
+  }
+  ctx->event = *cm;
+  ctx->tracked = c != NULL;
+  client_request(conn, c, sources, &ctx->client_cookies);
+  ctx->has_geometry_cookie = geometry;
+  if (geometry)
+    ctx->geometry = xcb_get_geometry(conn, cm->window);
+  deferred_client_messages++;
+  if (!sources && !geometry) {
+    continue_ordered(conn, finish_client_message, ctx);
+    return;
+  }
+  continue_after_barrier(conn, finish_client_message, ctx);
+}
 
-    if (index != -1) {
-      for (int i = 0; i < 4; i++) {
-        strncpy(fs_windows[index].monitor_output_names[i], ms[i]->output_name, OUTPUT_NAME_MAX - 1);
-        fs_windows[index].monitor_output_names[i][OUTPUT_NAME_MAX - 1] = '\0';
+static void handle_configure_request(xcb_connection_t *conn, xcb_configure_request_event_t *ev) {
+  configure_request_t single = { 0 };
+  configure_request_t *r = find_configure_request(ev->window);
+  if (r) {
+    stat_configures_merged++;
+  } else {
+    if (pending_configure_count == pending_configure_capacity) {
+      int capacity = pending_configure_capacity ? pending_configure_capacity * 2 : 16;
+      configure_request_t *grown = realloc(pending_configures, sizeof(*pending_configures) * capacity);
+      if (grown) {
+        pending_configures = grown;
+        pending_configure_capacity = capacity;
       }
-
-      fs_windows[index].has_monitors = 1;
-      fs_windows[index].is_monitor_fullscreen = 1;
-      fs_windows[index].is_general_fullscreen = 0;
     }
+    r = pending_configure_count < pending_configure_capacity ? &pending_configures[pending_configure_count++] : &single;
+    memset(r, 0, sizeof(*r));
+    r->window = ev->window;
+  }
 
-    xcb_flush(conn);
-  } else if (cm->type == atom_net_close_window) {
-    if (window_is_dock(conn, cm->window) || window_is_splash(conn, cm->window))
-      return;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_X)
+    r->x = ev->x;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_Y)
+    r->y = ev->y;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+    r->width = ev->width;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+    r->height = ev->height;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+    r->border_width = ev->border_width;
+  if (ev->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+    r->value_mask &= ~XCB_CONFIG_WINDOW_SIBLING;
+    r->sibling = ev->sibling;
+    r->stack_mode = ev->stack_mode;
+  }
+  r->value_mask |= ev->value_mask;
 
-    xcb_window_t target = cm->window;
-    if (window_supports_wm_delete(conn, target))
-      send_wm_delete(conn, target);
-    else
-      xcb_kill_client(conn, target);
+  if (r == &single)
+    apply_configure_request(conn, r);
+}
 
-    xcb_flush(conn);
-    return;
-  }
+static void flush_configure_requests(xcb_connection_t *conn) {
+  for (int i = 0; i < pending_configure_count; i++)
+    apply_configure_request(conn, &pending_configures[i]);
+  pending_configure_count = 0;
 }
 
 static void handle_destroy_notify(xcb_connection_t *conn, xcb_destroy_notify_event_t *ev, xcb_screen_t *screen) {
     xcb_window_t window = ev->window;
+    drop_configure_request(window);
+
+    client_t *c = find_client(window);
+    if (c && c->sync_alarm != XCB_NONE)
+      xcb_sync_destroy_alarm(conn, c->sync_alarm);
 
     if (is_always_on_top(window))
       remove_from_always_on_top(window);
 
-    if (is_fullscreen_window(window))
-      remove_fullscreen_window(conn, window);
+    int fullscreen_index = find_fullscreen_window(window);
+    if (fullscreen_index != -1)
+      untrack_fullscreen_window(fullscreen_index);
 
     int was_active = (window == active_window);
+    int monitor = focus_monitor_of(window);
     remove_focus(window);
     if (was_active) {
       active_window = XCB_WINDOW_NONE;
       remove_net_active_window(conn);
-      xcb_window_t new_focus = get_top_focus();
+      xcb_window_t new_focus = get_top_focus_on(monitor);
       if (new_focus != XCB_WINDOW_NONE)
         set_input_focus(conn, new_focus);
     }
-    xcb_flush(conn);
+    remove_client(window);
 }
 
-static void handle_map_request(xcb_connection_t *conn, xcb_map_request_event_t *ev) {
-  uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE };
-  xcb_change_window_attributes(conn, ev->window, XCB_CW_EVENT_MASK, values);
-  xcb_map_window(conn, ev->window);
+typedef struct {
+  xcb_window_t window;
+  uint64_t map_time;
+  int has_client;
+} map_focus_context_t;
+
+typedef struct {
+  xcb_window_t window;
+  int has_client;
+  client_cookies_t client_cookies;
+  xcb_get_geometry_cookie_t geometry;
+  xcb_get_property_cookie_t wm_name;
+} map_context_t;
+
+static void focus_map_request(xcb_connection_t *conn, void *reply, void *data) {
+  map_focus_context_t *ctx = data;
+  if (!reply)
+    return;
+
+  client_t *c = ctx->has_client ? find_client(ctx->window) : NULL;
+  if (ctx->has_client && !c)
+    return;
+  if (!c) {
+    if (!atom_list_contains(reply, atom_net_wm_window_type_dock) && !atom_list_contains(reply, atom_net_wm_window_type_splash))
+      set_input_focus(conn, ctx->window);
+    return;
+  }
+
+  collect_type(c, reply);
+  if (c->flags & CLIENT_DOCK)
+    add_to_always_on_top(ctx->window);
+  stack_insert(c);
+  if (c->flags & (CLIENT_DOCK | CLIENT_SPLASH))
+    return;
+
+  c->map_time_us = ctx->map_time;
+  set_input_focus(conn, ctx->window);
+}
+
+static void finish_map_request(xcb_connection_t *conn, void *reply, void *data) {
+  map_context_t *ctx = data;
+  xcb_get_property_reply_t *name_reply = reply;
+
+  client_t *c = ctx->has_client ? find_client(ctx->window) : NULL;
+  client_t gone = { 0 };
+  if (ctx->has_client) {
+    client_collect(conn, c ? c : &gone, &ctx->client_cookies);
+    free(gone.states);
+  }
+
+  xcb_get_geometry_reply_t *geom_reply = xcb_get_geometry_reply(conn, ctx->geometry, NULL);
+  if (geom_reply && c)
+    update_client_geometry(c, geom_reply->x, geom_reply->y, geom_reply->width, geom_reply->height);
+  free(geom_reply);
 
   xcb_icccm_get_text_property_reply_t prop;
-  if (xcb_icccm_get_wm_name_reply(conn, xcb_icccm_get_wm_name(conn, ev->window), &prop, NULL)) {
-    if (prop.name_len == 0) {
-      const char *default_name = "Unnamed";
-      xcb_change_property(conn, XCB_PROP_MODE_REPLACE, ev->window, atom_wm_name, XCB_ATOM_STRING, 8, strlen(default_name), default_name);
-    }
+  int have_wm_name = xcb_icccm_get_wm_name_reply(conn, ctx->wm_name, &prop, NULL);
+  int unnamed = have_wm_name && prop.name_len == 0;
+  if (have_wm_name)
     xcb_icccm_get_text_property_reply_wipe(&prop);
+
+  if (ctx->has_client && !c)
+    return;
+
+  if (unnamed) {
+    const char *default_name = "Unnamed";
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, ctx->window, atom_wm_name, XCB_ATOM_STRING, 8, strlen(default_name), default_name);
   }
 
-  xcb_get_property_cookie_t name_cookie = xcb_get_property(conn, 0, ev->window, atom_net_wm_name, atom_utf8_string, 0, 1024);
-  xcb_get_property_reply_t *name_reply = xcb_get_property_reply(conn, name_cookie, NULL);
-  if (name_reply) {
-    if (name_reply->value_len == 0) {
-      const char *default_net_name = "Unnamed";
-      xcb_change_property(conn, XCB_PROP_MODE_REPLACE, ev->window, atom_net_wm_name, atom_utf8_string, 8, strlen(default_net_name), default_net_name);
-    }
-    free(name_reply);
+  if (name_reply && name_reply->value_len == 0) {
+    const char *default_net_name = "Unnamed";
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, ctx->window, atom_net_wm_name, atom_utf8_string, 8, strlen(default_net_name), default_net_name);
   }
+}
 
-  if (window_is_dock(conn, ev->window)) {
-    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, ev->window, XCB_CONFIG_WINDOW_STACK_MODE, stack);
-    add_to_always_on_top(ev->window);
-    xcb_flush(conn);
+static void handle_map_request(xcb_connection_t *conn, xcb_map_request_event_t *ev) {
+  flush_configure_requests(conn);
+
+  uint64_t map_time = now_us();
+  uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE };
+  xcb_change_window_attributes(conn, ev->window, XCB_CW_EVENT_MASK, values);
+  xcb_change_save_set(conn, XCB_SET_MODE_INSERT, ev->window);
+  xcb_map_window(conn, ev->window);
+
+  map_focus_context_t *focus_ctx = malloc(sizeof(*focus_ctx));
+  map_context_t *ctx = calloc(1, sizeof(*ctx));
+  if (!focus_ctx || !ctx) {
+    free(focus_ctx);
+    free(ctx);
+    fprintf(stderr, "Out of memory managing window 0x%08x.\n", ev->window);
+    fflush(stderr);
     return;
   }
+  focus_ctx->window = ctx->window = ev->window;
+  focus_ctx->map_time = map_time;
 
-  if (window_is_splash(conn, ev->window)) {
-    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, ev->window, XCB_CONFIG_WINDOW_STACK_MODE, stack);
-    xcb_flush(conn);
-    return;
+  xcb_get_property_cookie_t type_cookie = xcb_get_property(conn, 0, ev->window, atom_net_wm_window_type, XCB_ATOM_ATOM, 0, 32);
+  continue_after(conn, type_cookie.sequence, focus_map_request, focus_ctx);
+
+  client_t *c = add_client(ev->window);
+  if (c) {
+    c->state_writes = 0;
+    client_request(conn, c, SOURCE_ALL & ~SOURCE_TYPE, &ctx->client_cookies);
+    focus_ctx->has_client = ctx->has_client = 1;
   }
 
-  set_input_focus(conn, ev->window);
-  for (int i = 0; i < always_on_top_count; i++) {
-    uint32_t stack_values[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, always_on_top_windows[i], XCB_CONFIG_WINDOW_STACK_MODE, stack_values);
+  ctx->geometry = xcb_get_geometry(conn, ev->window);
+  ctx->wm_name = xcb_icccm_get_wm_name(conn, ev->window);
+  xcb_get_property_cookie_t name_cookie = xcb_get_property(conn, 0, ev->window, atom_net_wm_name, atom_utf8_string, 0, 1024);
+  continue_after(conn, name_cookie.sequence, finish_map_request, ctx);
+}
+
+static void handle_map_notify(xcb_map_notify_event_t *ev) {
+  client_t *c = find_client(ev->window);
+  if (c)
+    c->flags |= CLIENT_MAPPED;
+}
+
+static void handle_unmap_notify(xcb_unmap_notify_event_t *ev) {
+  client_t *c = find_client(ev->window);
+  if (c) {
+    c->flags &= ~CLIENT_MAPPED;
+    stack_remove(c);
   }
-  xcb_flush(conn);
 }
 
-static void handle_focus_in(xcb_connection_t *conn, xcb_focus_in_event_t *ev) {
-  if (ev->mode != XCB_NOTIFY_MODE_NORMAL)
+static void handle_configure_notify(xcb_configure_notify_event_t *ev) {
+  client_t *c = find_client(ev->window);
+  if (!c)
     return;
 
-  if (ev->detail != XCB_NOTIFY_DETAIL_POINTER && ev->detail != XCB_NOTIFY_DETAIL_NONE)
-    return;
+  update_client_geometry(c, ev->x, ev->y, ev->width, ev->height);
+}
 
-  xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(conn, xcb_get_window_attributes(conn, ev->event), NULL);
+typedef struct {
+  xcb_window_t window;
+  client_cookies_t cookies;
+} focus_context_t;
+
+static void finish_focus_in(xcb_connection_t *conn, void *reply, void *data) {
+  focus_context_t *ctx = data;
+  client_t *c = find_client(ctx->window);
+  client_t gone = { 0 };
+  if (ctx->cookies.sources) {
+    client_collect(conn, c ? c : &gone, &ctx->cookies);
+    free(gone.states);
+  }
 
-  if (!attr)
+  if (!c || (c->flags & (CLIENT_OVERRIDE_REDIRECT | CLIENT_DOCK | CLIENT_SPLASH)))
     return;
 
-  if (attr->override_redirect) {
-    free(attr);
-    return;
+  set_input_focus(conn, ctx->window);
+}
+
+static void handle_focus_in(xcb_connection_t *conn, xcb_focus_in_event_t *ev) {
+  client_t *c = find_client(ev->event);
+  if (c && c->map_time_us) {
+    metric_record(&metrics[METRIC_MAP_TO_FOCUS], now_us() - c->map_time_us);
+    c->map_time_us = 0;
   }
 
-  free(attr);
+  if (ev->mode != XCB_NOTIFY_MODE_NORMAL)
+    return;
 
-  if (window_is_dock(conn, ev->event) || window_is_splash(conn, ev->event))
+  if (ev->detail != XCB_NOTIFY_DETAIL_POINTER && ev->detail != XCB_NOTIFY_DETAIL_NONE)
     return;
 
-  set_input_focus(conn, ev->event);
+  c = add_client(ev->event);
+  focus_context_t *ctx = calloc(1, sizeof(*ctx));
+  if (!c || !ctx) {
+    free(ctx);
+    return;
+  }
+  ctx->window = ev->event;
+
+  uint32_t sources = c->stale & flag_sources(CLIENT_OVERRIDE_REDIRECT | CLIENT_DOCK | CLIENT_SPLASH);
+  if (sources) {
+    client_request(conn, c, sources, &ctx->cookies);
+    continue_after_barrier(conn, finish_focus_in, ctx);
+  } else {
+    continue_ordered(conn, finish_focus_in, ctx);
+  }
 }
 
 static void handle_focus_out(xcb_connection_t *conn, xcb_focus_out_event_t *ev, xcb_screen_t *screen) {
   if (ev->event == active_window) {
+    int monitor = focus_monitor_of(ev->event);
     remove_focus(ev->event);
 
-    xcb_window_t new_focus = get_top_focus();
+    xcb_window_t new_focus = get_top_focus_on(monitor);
     if (new_focus != XCB_WINDOW_NONE) {
       set_input_focus(conn, new_focus);
     } else {
@@ -1344,26 +4093,6 @@ static void handle_focus_out(xcb_connection_t *conn, xcb_focus_out_event_t *ev,
       remove_net_active_window(conn);
     }
   }
-  xcb_flush(conn);
-}
-
-static void handle_configure_request(xcb_connection_t *conn, xcb_configure_request_event_t *ev) {
-  uint32_t values[7];
-  uint16_t mask = 0;
-  int i = 0;
-
-  ev->value_mask & XCB_CONFIG_WINDOW_X && (values[i] = ev->x, mask |= XCB_CONFIG_WINDOW_X, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_Y && (values[i] = ev->y, mask |= XCB_CONFIG_WINDOW_Y, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_WIDTH && (values[i] = ev->width, mask |= XCB_CONFIG_WINDOW_WIDTH, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_HEIGHT && (values[i] = ev->height, mask |= XCB_CONFIG_WINDOW_HEIGHT, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH && (values[i] = ev->border_width, mask |= XCB_CONFIG_WINDOW_BORDER_WIDTH, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_SIBLING && (values[i] = ev->sibling, mask |= XCB_CONFIG_WINDOW_SIBLING, i++);
-  ev->value_mask & XCB_CONFIG_WINDOW_STACK_MODE && (values[i] = ev->stack_mode, mask |= XCB_CONFIG_WINDOW_STACK_MODE, i++);
-
-  if (i > 0) {
-    xcb_configure_window(conn, ev->window, mask, values);
-  }
-  xcb_flush(conn);
 }
 
 static int monitor_layout_changed() {
@@ -1393,6 +4122,70 @@ static void save_monitor_layout_state() {
 
   for (int i = 0; i < monitor_count; i++)
     previous_monitors[i] = monitors[i];
+
+  rebuild_monitor_clients();
+}
+
+static int monitor_still_present(const monitor_t *old) {
+  for (int i = 0; i < monitor_count; i++) {
+    if (monitors[i].x == old->x && monitors[i].y == old->y &&
+        monitors[i].width == old->width && monitors[i].height == old->height)
+      return 1;
+  }
+  return 0;
+}
+
+static int on_any_monitor(const xcb_rectangle_t *g) {
+  for (int i = 0; i < monitor_count; i++) {
+    if (g->x + g->width > monitors[i].x && g->x < monitors[i].x + monitors[i].width &&
+        g->y + g->height > monitors[i].y && g->y < monitors[i].y + monitors[i].height)
+      return 1;
+  }
+  return 0;
+}
+
+static void adjust_windows_within_bounds(xcb_connection_t *conn) {
+  uint64_t changed = 1ULL << OFFSCREEN_MONITOR;
+  int count = monitor_client_count[OFFSCREEN_MONITOR];
+  for (int i = 0; i < previous_monitor_count; i++) {
+    if (!monitor_still_present(&previous_monitors[i])) {
+      changed |= 1ULL << i;
+      count += monitor_client_count[i];
+    }
+  }
+  if (count == 0)
+    return;
+
+  client_t **affected = malloc(sizeof(client_t *) * count);
+  if (!affected)
+    return;
+
+  int n = 0;
+  for (int i = 0; i <= OFFSCREEN_MONITOR; i++) {
+    if (!(changed & (1ULL << i)))
+      continue;
+    memcpy(&affected[n], monitor_clients[i], sizeof(client_t *) * monitor_client_count[i]);
+    n += monitor_client_count[i];
+  }
+
+  monitor_t *primary = get_primary_monitor();
+  if (!primary)
+    primary = (monitor_count > 0) ? &monitors[0] : NULL;
+
+  for (int i = 0; i < n && primary; i++) {
+    client_t *c = affected[i];
+    if (c->flags & (CLIENT_DOCK | CLIENT_SPLASH | CLIENT_OVERRIDE_REDIRECT))
+      continue;
+    if (is_fullscreen_window(c->window) || on_any_monitor(&c->geometry))
+      continue;
+
+    int width = c->geometry.width > primary->width ? primary->width : c->geometry.width;
+    int height = c->geometry.height > primary->height ? primary->height : c->geometry.height;
+
+    configure_window_geometry(conn, c->window, primary->x, primary->y, width, height);
+  }
+
+  free(affected);
 }
 
 static void configure_if_changed(
@@ -1403,34 +4196,16 @@ static void configure_if_changed(
   int width,
   int height
 ) {
-  xcb_get_geometry_cookie_t gc = xcb_get_geometry(conn, window);
-  xcb_get_geometry_reply_t *gr = xcb_get_geometry_reply(conn, gc, NULL);
-
-  if (!gr)
+  client_t *c = find_client(window);
+  if (c && (c->flags & CLIENT_HAS_GEOMETRY) &&
+      c->geometry.x == x && c->geometry.y == y && c->geometry.width == width && c->geometry.height == height)
     return;
 
-  if (gr->x != x || gr->y != y || gr->width != width || gr->height != height) {
-    uint32_t values[] = { x, y, width, height };
-    uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-    xcb_configure_window(conn, window, mask, values);
-    send_configure_notify(conn, window, x, y, width, height);
-  }
-
-  free(gr);
+  configure_window_geometry(conn, window, x, y, width, height);
 }
 
-static void handle_randr_event(xcb_connection_t *conn, xcb_generic_event_t *event, xcb_screen_t *screen, uint8_t randr_event_base) {
-  uint8_t type = event->response_type & ~0x80;
-
-  if (type == randr_event_base + XCB_RANDR_NOTIFY) {
-    xcb_randr_notify_event_t *re = (xcb_randr_notify_event_t *)event;
-    if (re->subCode != XCB_RANDR_NOTIFY_CRTC_CHANGE && re->subCode != XCB_RANDR_NOTIFY_OUTPUT_CHANGE && re->subCode != XCB_RANDR_NOTIFY_OUTPUT_PROPERTY)
-      return;
-  } else if (type != randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
-    return;
-  }
-
-  query_xrandr(conn, screen);
+static void apply_monitor_layout(xcb_connection_t *conn, xcb_screen_t *screen) {
+  rebuild_monitor_focus();
 
   if (real_total_width <= 0 || real_total_height <= 0)
     return;
@@ -1440,13 +4215,13 @@ static void handle_randr_event(xcb_connection_t *conn, xcb_generic_event_t *even
 
   total_width = real_total_width;
   total_height = real_total_height;
-  adjust_windows_within_bounds(conn, screen);
+  adjust_windows_within_bounds(conn);
 
   for (int i = 0; i < fullscreen_count; i++) {
     xcb_window_t window = fs_windows[i].window;
-    if (fs_windows[i].has_monitors) {
+    if (fs_windows[i].flags & FULLSCREEN_HAS_MONITORS) {
       int x1, y1, x2, y2;
-      if (calculate_fullscreen_geometry_names(fs_windows[i].monitor_output_names, &x1, &y1, &x2, &y2) == 0) {
+      if (calculate_fullscreen_geometry_names(fs_geometry[i].monitor_names, &x1, &y1, &x2, &y2) == 0) {
         int width = x2 - x1;
         int height = y2 - y1;
         configure_if_changed(conn, window, x1, y1, width, height);
@@ -1459,19 +4234,14 @@ static void handle_randr_event(xcb_connection_t *conn, xcb_generic_event_t *even
     }
   }
 
-  for (int i = 0; i < fullscreen_count; i++) {
-    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, fs_windows[i].window, XCB_CONFIG_WINDOW_STACK_MODE, stack);
-  }
-  for (int i = 0; i < always_on_top_count; i++) {
-    uint32_t stack[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(conn, always_on_top_windows[i], XCB_CONFIG_WINDOW_STACK_MODE, stack);
-  }
-
-  set_wallpaper(conn, screen);
+  paint_wallpaper(conn, screen);
   update_touch_devices(conn);
   save_monitor_layout_state();
-  xcb_flush(conn);
+}
+
+static void handle_randr_event(xcb_connection_t *conn, xcb_screen_t *screen) {
+  query_xrandr(conn, screen);
+  apply_monitor_layout(conn, screen);
 }
 
 static void select_xinput_events(xcb_connection_t *conn, xcb_window_t window) {
@@ -1488,35 +4258,195 @@ static void select_xinput_events(xcb_connection_t *conn, xcb_window_t window) {
   free(evmask);
 }
 
-static void handle_xi_hierarchy_event(xcb_connection_t *conn, xcb_input_hierarchy_event_t *event) {
-  if (event->flags & (XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED | XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED | XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED))
-    update_touch_devices(conn);
+static void startup_mark(const char *phase) {
+  if (!profile_startup)
+    return;
+
+  fprintf(stderr, "startup %8.2f ms  %s\n", (now_us() - startup_us) / 1000.0, phase);
+  fflush(stderr);
 }
 
 static void initial_randr_apply(xcb_connection_t *conn, xcb_screen_t *screen) {
   query_xrandr(conn, screen);
-  adjust_windows_within_bounds(conn, screen);
+  if (real_total_width > 0 && real_total_height > 0) {
+    total_width = real_total_width;
+    total_height = real_total_height;
+  }
+
+  if (!root_pixmap_mode) {
+    uint32_t none = XCB_NONE;
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_BACK_PIXMAP, &none);
+    xcb_clear_area(conn, 0, screen->root, 0, 0, (uint16_t)total_width, (uint16_t)total_height);
+  }
+  load_touch_devices(conn);
+  save_monitor_layout_state();
+  wallpaper_pending = 1;
+}
 
-  uint32_t none = XCB_NONE;
-  xcb_change_window_attributes(conn, screen->root, XCB_CW_BACK_PIXMAP, &none);
-  xcb_clear_area(conn, 0, screen->root, 0, 0, (uint16_t)total_width, (uint16_t)total_height);
+static void load_initial_wallpaper(xcb_connection_t *conn, xcb_screen_t *screen) {
   const char *home = getenv("HOME");
   char path[1024];
   snprintf(path, sizeof(path), "%s/.sinwm.png", home);
   load_wallpaper(conn, screen, path);
-  set_wallpaper(conn, screen);
-  update_touch_devices(conn);
+  paint_wallpaper(conn, screen);
+}
 
-  xcb_flush(conn);
+typedef struct {
+  xcb_get_window_attributes_cookie_t attributes;
+  xcb_get_geometry_cookie_t geometry;
+  client_cookies_t client;
+} adopt_cookies_t;
+
+static int adopt_windows(xcb_connection_t *conn, xcb_screen_t *screen) {
+  xcb_query_tree_cookie_t tree_cookie = xcb_query_tree(conn, screen->root);
+  xcb_get_property_cookie_t state_cookie = xcb_get_property(conn, 0, screen->root, atom_sinwm_state, XCB_ATOM_CARDINAL, 0, UINT32_MAX);
+  xcb_get_property_cookie_t active_cookie = xcb_get_property(conn, 0, screen->root, atom_net_active_window, XCB_ATOM_WINDOW, 0, 1);
+
+  xcb_query_tree_reply_t *tree = WAIT_REPLY(xcb_query_tree_reply(conn, tree_cookie, NULL));
+  int n = tree ? xcb_query_tree_children_length(tree) : 0;
+  xcb_window_t *children = tree ? xcb_query_tree_children(tree) : NULL;
+  adopt_cookies_t *cookies = n > 0 ? calloc(n, sizeof(*cookies)) : NULL;
+  if (!cookies)
+    n = 0;
+
+  for (int i = 0; i < n; i++) {
+    cookies[i].attributes = xcb_get_window_attributes(conn, children[i]);
+    cookies[i].geometry = xcb_get_geometry(conn, children[i]);
+    client_t probe = { .window = children[i] };
+    client_request(conn, &probe, SOURCE_ALL & ~SOURCE_ATTRIBUTES, &cookies[i].client);
+  }
+
+  xcb_get_property_reply_t *saved = WAIT_REPLY(xcb_get_property_reply(conn, state_cookie, NULL));
+  xcb_get_property_reply_t *active_reply = WAIT_REPLY(xcb_get_property_reply(conn, active_cookie, NULL));
+  xcb_window_t active = XCB_WINDOW_NONE;
+  if (active_reply && active_reply->type == XCB_ATOM_WINDOW && xcb_get_property_value_length(active_reply) >= 4)
+    active = *(xcb_window_t *)xcb_get_property_value(active_reply);
+  free(active_reply);
+
+  int adopted = 0;
+  for (int i = 0; i < n; i++) {
+    xcb_window_t window = children[i];
+    xcb_get_window_attributes_reply_t *attr = WAIT_REPLY(xcb_get_window_attributes_reply(conn, cookies[i].attributes, NULL));
+    xcb_get_geometry_reply_t *geom = WAIT_REPLY(xcb_get_geometry_reply(conn, cookies[i].geometry, NULL));
+    int manage = attr && geom && window != wm_support_window &&
+                 attr->map_state == XCB_MAP_STATE_VIEWABLE && !attr->override_redirect;
+    client_t *c = manage ? add_client(window) : NULL;
+    client_t gone = { 0 };
+    client_collect(conn, c ? c : &gone, &cookies[i].client);
+    free(gone.states);
+    if (!c) {
+      free(attr);
+      free(geom);
+      continue;
+    }
+
+    uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE };
+    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, values);
+    c->flags |= CLIENT_MAPPED;
+    update_client_geometry(c, geom->x, geom->y, geom->width, geom->height);
+
+    int special = (c->flags & (CLIENT_DOCK | CLIENT_SPLASH)) != 0;
+    if ((c->flags & CLIENT_DOCK) || (c->flags & CLIENT_ABOVE))
+      add_to_always_on_top(window);
+
+    if (!special && (c->flags & CLIENT_FULLSCREEN)) {
+      uint16_t names[4] = { 0 };
+      const uint32_t *record = find_saved_fullscreen(saved, window, names);
+      xcb_rectangle_t original = { geom->x, geom->y, geom->width, geom->height };
+      int monitor = monitor_at(geom->x + geom->width / 2, geom->y + geom->height / 2);
+      if (record)
+        original = (xcb_rectangle_t){ (int16_t)(record[2] >> 16), (int16_t)(record[2] & 0xFFFF), record[3] >> 16, record[3] & 0xFFFF };
+      else if (monitor >= 0 || monitor_count > 0)
+        original = centered_geometry(&monitors[monitor >= 0 ? monitor : 0]);
+
+      int index = track_fullscreen_window(window, &original);
+      if (index != -1) {
+        fs_windows[index].flags = record ? record[1] : FULLSCREEN_GENERAL;
+        memcpy(fs_geometry[index].monitor_names, names, sizeof(names));
+      }
+    }
+
+    stack_adopt(c);
+    if (!special)
+      push_focus(window);
+    adopted++;
+
+    free(attr);
+    free(geom);
+  }
+
+  client_t *a = find_client(active);
+  if (a && (a->flags & CLIENT_FOCUS_LIST))
+    set_input_focus(conn, active);
+  else if (get_top_focus() != XCB_WINDOW_NONE)
+    set_input_focus(conn, get_top_focus());
+
+  free(saved);
+  free(cookies);
+  free(tree);
+  wm_state_dirty = 1;
+  return adopted;
 }
 
-int main() {
+static int wait_for_work(xcb_connection_t *conn, int signal_fd, xcb_generic_event_t **event) {
+  for (;;) {
+    *event = xcb_poll_for_event(conn);
+    if (*event || continuation_ready(conn) || wallpaper_pending)
+      return 1;
+    if (xcb_connection_has_error(conn))
+      return 0;
+    int timeout = sync_timeout_ms();
+    if (timeout == 0)
+      return 1;
+
+    struct pollfd fds[] = {
+      { .fd = xcb_get_file_descriptor(conn), .events = POLLIN },
+      { .fd = signal_fd, .events = POLLIN }
+    };
+    if (poll(fds, signal_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+      return 0;
+
+    if (signal_fd >= 0 && (fds[1].revents & POLLIN)) {
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+        dump_metrics();
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  startup_us = now_us();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--root-pixmap") == 0) {
+      root_pixmap_mode = 1;
+    } else if (strcmp(argv[i], "--profile-startup") == 0) {
+      profile_startup = 1;
+    } else {
+      fprintf(stderr, "Usage: %s [--root-pixmap] [--profile-startup]\n", argv[0]);
+      fflush(stderr);
+      return -1;
+    }
+  }
+
+  setup_metrics();
+
+  sigset_t metrics_signals;
+  sigemptyset(&metrics_signals);
+  sigaddset(&metrics_signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &metrics_signals, NULL);
+  int signal_fd = signalfd(-1, &metrics_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
   xcb_connection_t *conn = xcb_connect(NULL, NULL);
   if (xcb_connection_has_error(conn)) {
     fprintf(stderr, "Unable to connect to the X server\n");
     fflush(stderr);
     return -1;
   }
+  startup_mark("connected");
+
+  xcb_prefetch_extension_data(conn, &xcb_randr_id);
+  xcb_prefetch_extension_data(conn, &xcb_input_id);
+  xcb_prefetch_extension_data(conn, &xcb_sync_id);
 
   xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
   xcb_screen_t *screen = iter.data;
@@ -1525,9 +4455,13 @@ int main() {
                       | XCB_EVENT_MASK_PROPERTY_CHANGE
                       | XCB_EVENT_MASK_STRUCTURE_NOTIFY
                       | XCB_EVENT_MASK_FOCUS_CHANGE
-                      | XCB_EVENT_MASK_EXPOSURE;
+                      | (root_pixmap_mode ? 0 : XCB_EVENT_MASK_EXPOSURE);
   xcb_void_cookie_t cookie = xcb_change_window_attributes_checked(conn, screen->root, XCB_CW_EVENT_MASK, &event_mask);
-  xcb_generic_error_t *error = xcb_request_check(conn, cookie);
+
+  setup_atoms(conn);
+  startup_mark("atoms interned");
+
+  xcb_generic_error_t *error = WAIT_REPLY(xcb_request_check(conn, cookie));
   if (error) {
     fprintf(stderr, "Another window manager is already running (error code %d).\n", error->error_code);
     fflush(stderr);
@@ -1544,18 +4478,6 @@ int main() {
     return -1;
   }
   uint8_t randr_event_base = randr_reply->first_event;
-  xcb_randr_select_input(conn, screen->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
-  xcb_flush(conn);
-
-  setup_atoms(conn);
-  setup_ewmh(conn, screen);
-
-  initial_randr_apply(conn, screen);
-  handle_randr_event(conn, &(xcb_generic_event_t){ .response_type = randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY }, screen, randr_event_base);
-
-  xcb_cursor_t blank_cursor = create_blank_cursor(conn, screen);
-  uint32_t cursors[] = {blank_cursor};
-  xcb_change_window_attributes(conn, screen->root, XCB_CW_CURSOR, cursors);
 
   const xcb_query_extension_reply_t *xinput_reply = xcb_get_extension_data(conn, &xcb_input_id);
   if (!xinput_reply || !xinput_reply->present) {
@@ -1565,37 +4487,171 @@ int main() {
     return -1;
   }
   uint8_t xinput_opcode = xinput_reply->major_opcode;
+
+  const xcb_query_extension_reply_t *sync_reply = xcb_get_extension_data(conn, &xcb_sync_id);
+  uint8_t sync_event_base = 0;
+  if (sync_reply && sync_reply->present) {
+    sync_event_base = sync_reply->first_event;
+    have_sync = 1;
+    xcb_discard_reply(conn, xcb_sync_initialize(conn, 3, 1).sequence);
+  }
+  startup_mark("redirect and extensions checked");
+
+  xcb_randr_query_version_cookie_t randr_version_cookie = xcb_randr_query_version(conn, 1, 5);
+  xcb_randr_select_input(conn, screen->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+  setup_ewmh(conn, screen);
+
+  xcb_cursor_t blank_cursor = create_blank_cursor(conn, screen);
+  uint32_t cursors[] = {blank_cursor};
+  xcb_change_window_attributes(conn, screen->root, XCB_CW_CURSOR, cursors);
   select_xinput_events(conn, screen->root);
 
+  xcb_randr_query_version_reply_t *randr_version = WAIT_REPLY(xcb_randr_query_version_reply(conn, randr_version_cookie, NULL));
+  if (randr_version) {
+    randr_has_monitors = randr_version->major_version > 1 || (randr_version->major_version == 1 && randr_version->minor_version >= 5);
+    free(randr_version);
+  }
+  startup_mark("EWMH set up");
+
+  initial_randr_apply(conn, screen);
+  startup_mark("monitors applied");
+
+  char adopted[64];
+  snprintf(adopted, sizeof(adopted), "adopted %d windows", adopt_windows(conn, screen));
+  adjust_windows_within_bounds(conn);
+  startup_mark(adopted);
+
   xcb_flush(conn);
+  startup_mark("managing windows");
 
   xcb_generic_event_t *event;
-  while ((event = xcb_wait_for_event(conn))) {
-    uint8_t type = event->response_type & ~0x80;
-
-    if (type == randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
-      handle_randr_event(conn, event, screen, randr_event_base);
-    } else if (type == randr_event_base + XCB_RANDR_NOTIFY) {
-      xcb_randr_notify_event_t *re = (xcb_randr_notify_event_t *)event;
-      if (re->subCode == XCB_RANDR_NOTIFY_CRTC_CHANGE || re->subCode == XCB_RANDR_NOTIFY_OUTPUT_CHANGE || re->subCode == XCB_RANDR_NOTIFY_OUTPUT_PROPERTY) {
-        handle_randr_event(conn, event, screen, randr_event_base);
+  while (wait_for_work(conn, signal_fd, &event)) {
+    int randr_pending = 0;
+    int randr_patched = 0;
+    int screen_width = -1, screen_height = -1;
+    int expose_pending = 0;
+    unsigned int batch_events = 0;
+    uint64_t batch_start = now_us();
+
+    while (event) {
+      uint8_t type = event->response_type & ~0x80;
+      last_event_sequence = event->full_sequence;
+      batch_events++;
+
+      if (type == randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+        uint64_t start = metric_begin(&metrics[METRIC_RANDR_NOTIFY]);
+        xcb_randr_screen_change_notify_event_t *se = (xcb_randr_screen_change_notify_event_t *)event;
+        int swap = (se->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270)) != 0;
+        screen_width = swap ? se->height : se->width;
+        screen_height = swap ? se->width : se->height;
+        primary_output_valid = 0;
+        metric_end(start);
+      } else if (type == randr_event_base + XCB_RANDR_NOTIFY) {
+        uint64_t start = metric_begin(&metrics[METRIC_RANDR_NOTIFY]);
+        xcb_randr_notify_event_t *re = (xcb_randr_notify_event_t *)event;
+        if (re->subCode == XCB_RANDR_NOTIFY_OUTPUT_CHANGE) {
+          primary_output_valid = 0;
+          randr_pending = 1;
+        } else if (re->subCode == XCB_RANDR_NOTIFY_CRTC_CHANGE && !randr_pending) {
+          if (patch_monitor_crtc(&re->u.cc))
+            randr_patched = 1;
+          else
+            randr_pending = 1;
+        }
+        metric_end(start);
+      } else if (have_sync && type == sync_event_base + XCB_SYNC_ALARM_NOTIFY) {
+        uint64_t start = metric_begin(&metrics[METRIC_SYNC_ALARM]);
+        handle_sync_alarm(conn, (xcb_sync_alarm_notify_event_t *)event);
+        metric_end(start);
+      } else if (type == XCB_GE_GENERIC) {
+        uint64_t start = metric_begin(&metrics[METRIC_XI_HIERARCHY]);
+        xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
+        if (ge->extension == xinput_opcode && ge->event_type == XCB_INPUT_HIERARCHY)
+          handle_xi_hierarchy(conn, (xcb_input_hierarchy_event_t *)event);
+        metric_end(start);
+      } else {
+        metric_t *m = &metrics[METRIC_OTHER];
+        if (type == XCB_MAP_REQUEST) m = &metrics[METRIC_MAP_REQUEST];
+        if (type == XCB_CONFIGURE_REQUEST) m = &metrics[METRIC_CONFIGURE_REQUEST];
+        if (type == XCB_CLIENT_MESSAGE) m = client_message_metric(((xcb_client_message_event_t *)event)->type);
+        if (type == XCB_DESTROY_NOTIFY) m = &metrics[METRIC_DESTROY_NOTIFY];
+        if (type == XCB_FOCUS_IN) m = &metrics[METRIC_FOCUS_IN];
+        if (type == XCB_FOCUS_OUT) m = &metrics[METRIC_FOCUS_OUT];
+        if (type == XCB_PROPERTY_NOTIFY) m = &metrics[METRIC_PROPERTY_NOTIFY];
+        if (type == XCB_EXPOSE) m = &metrics[METRIC_EXPOSE];
+
+        uint64_t start = metric_begin(m);
+        if (type == XCB_MAP_REQUEST) handle_map_request(conn, (xcb_map_request_event_t *)event);
+        if (type == XCB_CONFIGURE_REQUEST) handle_configure_request(conn, (xcb_configure_request_event_t *)event);
+        if (type == XCB_CLIENT_MESSAGE) handle_client_message(conn, (xcb_client_message_event_t *)event, screen);
+        if (type == XCB_DESTROY_NOTIFY) handle_destroy_notify(conn, (xcb_destroy_notify_event_t *)event, screen);
+        if (type == XCB_FOCUS_IN) handle_focus_in(conn, (xcb_focus_in_event_t *)event);
+        if (type == XCB_FOCUS_OUT) handle_focus_out(conn, (xcb_focus_out_event_t *)event, screen);
+        if (type == XCB_PROPERTY_NOTIFY) handle_property_notify((xcb_property_notify_event_t *)event);
+        if (type == XCB_CONFIGURE_NOTIFY) handle_configure_notify((xcb_configure_notify_event_t *)event);
+        if (type == XCB_MAP_NOTIFY) handle_map_notify((xcb_map_notify_event_t *)event);
+        if (type == XCB_UNMAP_NOTIFY) handle_unmap_notify((xcb_unmap_notify_event_t *)event);
+        if (type == XCB_EXPOSE) handle_expose((xcb_expose_event_t *)event, screen, &expose_pending);
+        metric_end(start);
       }
-    } else if (type == XCB_GE_GENERIC) {
-      xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
-      if (ge->extension == xinput_opcode && ge->event_type == XCB_INPUT_HIERARCHY)
-        handle_xi_hierarchy_event(conn, (xcb_input_hierarchy_event_t *)event);
-    } else {
-      if (type == XCB_MAP_REQUEST) handle_map_request(conn, (xcb_map_request_event_t *)event);
-      if (type == XCB_CONFIGURE_REQUEST) handle_configure_request(conn, (xcb_configure_request_event_t *)event);
-      if (type == XCB_CLIENT_MESSAGE) handle_client_message(conn, (xcb_client_message_event_t *)event, screen);
-      if (type == XCB_DESTROY_NOTIFY) handle_destroy_notify(conn, (xcb_destroy_notify_event_t *)event, screen);
-      if (type == XCB_FOCUS_IN) handle_focus_in(conn, (xcb_focus_in_event_t *)event);
-      if (type == XCB_FOCUS_OUT) handle_focus_out(conn, (xcb_focus_out_event_t *)event, screen);
-      if (type == XCB_EXPOSE) set_wallpaper(conn, screen);
+      free(event);
+      if (batch_events >= MAX_BATCH_EVENTS || now_us() - batch_start >= MAX_BATCH_US) {
+        stat_batches_capped++;
+        event = NULL;
+      } else {
+        event = xcb_poll_for_event(conn);
+      }
+    }
+
+    flush_configure_requests(conn);
+    expire_sync_requests(conn);
+    run_continuations(conn);
+
+    if (!randr_pending && (randr_patched || screen_width >= 0)) {
+      uint64_t start = metric_begin(&metrics[METRIC_RANDR_PATCH]);
+      if (randr_patched)
+        refresh_patched_monitors(conn);
+      if (screen_width >= 0 && (screen_width != real_total_width || screen_height != real_total_height))
+        randr_pending = 1;
+      else if (randr_patched)
+        apply_monitor_layout(conn, screen);
+      if (!randr_pending && screen_width >= 0)
+        refresh_primary_output(conn, screen);
+      metric_end(start);
+    }
+    if (randr_pending) {
+      uint64_t start = metric_begin(&metrics[METRIC_RANDR_APPLY]);
+      handle_randr_event(conn, screen);
+      metric_end(start);
+    }
+    if (expose_pending) {
+      uint64_t start = metric_begin(&metrics[METRIC_EXPOSE_REPAINT]);
+      repaint_damage(conn, screen);
+      metric_end(start);
+    }
+    if (stack_dirty) {
+      uint64_t start = metric_begin(&metrics[METRIC_RESTACK]);
+      stack_sync(conn, screen->root);
+      metric_end(start);
+    }
+
+    if (wm_state_dirty)
+      save_wm_state(conn, screen->root);
+
+    flush_batch(conn, batch_events);
+
+    if (wallpaper_pending) {
+      wallpaper_pending = 0;
+      load_initial_wallpaper(conn, screen);
+      xcb_flush(conn);
+      startup_mark("wallpaper painted");
     }
-    free(event);
   }
 
+  print_metrics(stderr);
+  if (signal_fd >= 0)
+    close(signal_fd);
+
   if (active_window != XCB_WINDOW_NONE)
     remove_net_active_window(conn);
 
@@ -1604,6 +4660,16 @@ int main() {
     pixmap = XCB_PIXMAP_NONE;
   }
 
+  if (root_pixmap != XCB_PIXMAP_NONE) {
+    xcb_delete_property(conn, screen->root, atom_xrootpmap_id);
+    xcb_delete_property(conn, screen->root, atom_esetroot_pmap_id);
+    xcb_free_pixmap(conn, root_pixmap);
+    root_pixmap = XCB_PIXMAP_NONE;
+  }
+
+  if (wallpaper_gc != XCB_NONE)
+    xcb_free_gc(conn, wallpaper_gc);
+
   if (wm_support_window != XCB_WINDOW_NONE)
     xcb_destroy_window(conn, wm_support_window);
 